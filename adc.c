@@ -1,4 +1,24 @@
 #include "adc.h"
+#include <avr/interrupt.h>
+#include "os.h"
+
+/* Timer0 counts between scans with the 1024 prescaler */
+#define SCANCOUNT ((16000000UL / 1024) * ADC_SCANMSEC / 1000)
+
+/* ADCSRB auto trigger source: Timer0 compare match A */
+#define TRIGGER_TIMER0_COMPA ((1<<ADTS1)|(1<<ADTS0))
+
+/* Scan state, the ISR owns Slot and the back half of Sample */
+static uint8_t Channel[ADC_MAXCHANNELS];
+static volatile uint8_t Count = 0;
+static volatile uint8_t Slot = 0;
+static volatile uint16_t Sample[2][ADC_MAXCHANNELS];
+static volatile uint8_t Front = 0;          //half of Sample holding the last full scan
+static volatile uint8_t Scans = 0;          //completed scans, wraps
+static FILTER *Filter[ADC_MAXCHANNELS];    //optional per slot, run by the ISR
+static EVENT ScanEvent;
+static uint8_t HaveEvent = 0;
+static volatile uint8_t Waiters = 0;        //tasks in WaitADCScan()
 
 void InitADC(void)
 {
@@ -12,4 +32,126 @@ uint16_t readadc(uint8_t ch)
 	ADCSRA|=(1<<ADSC);        //START CONVERSION
 	while((ADCSRA)&(1<<ADSC));    //WAIT UNTIL CONVERSION IS COMPLETE
 	return(ADC);        //RETURN ADC VALUE
+}
+
+/*
+ * Timer0 compare match A starts the first conversion of every scan. Each
+ * conversion complete interrupt stores the result, selects the next channel
+ * in the list and, until the list is done, starts it. At the end of a list
+ * the halves of the table are swapped so readers always see a complete scan,
+ * and the kernel is only entered if a task waits for it.
+ */
+ISR(ADC_vect)
+{
+	uint8_t back = Front ^ 1;
+
+	TIFR0 = (1<<OCF0A);     //THE NEXT COMPARE MATCH MUST BE A NEW EDGE
+
+	if(Filter[Slot]){
+		Sample[back][Slot] = Filter_Update(Filter[Slot], ADC);
+	}else{
+		Sample[back][Slot] = ADC;
+	}
+
+	if(++Slot >= Count){
+		Slot = 0;
+		Front = back;
+		Scans++;
+		ADMUX = (ADMUX & 0xf8)|Channel[0];   //READY FOR THE NEXT TRIGGER
+
+		if(Waiters){
+			Event_BroadcastFromISR(ScanEvent);
+		}
+		return;
+	}
+
+	ADMUX = (ADMUX & 0xf8)|Channel[Slot];
+	ADCSRA|=(1<<ADSC);
+}
+
+void StartADCScan(const uint8_t *channels, uint8_t count)
+{
+	uint8_t i;
+
+	if(count == 0 || count > ADC_MAXCHANNELS) return;
+
+	ADCSRA&=~((1<<ADIE)|(1<<ADATE));
+	while((ADCSRA)&(1<<ADSC));    //LET A PENDING CONVERSION FINISH
+
+	for(i = 0; i < count; i++){
+		Channel[i] = channels[i] & 0b00000111;
+		Sample[0][i] = 0;
+		Sample[1][i] = 0;
+	}
+	Count = count;
+	Slot = 0;
+
+	if(!HaveEvent){
+		ScanEvent = Event_Init();
+		HaveEvent = 1;
+	}
+
+	ADMUX = (ADMUX & 0xf8)|Channel[0];
+
+	TCCR0A = (1<<WGM01);              //TIMER0 CTC MODE, TOP IS OCR0A
+	TCCR0B = (1<<CS02)|(1<<CS00);     //PRESCALER 1024
+	OCR0A = SCANCOUNT - 1;
+	TIFR0 = (1<<OCF0A);
+
+	ADCSRB = (ADCSRB & 0xf8)|TRIGGER_TIMER0_COMPA;
+	ADCSRA|=(1<<ADIF);                //CLEAR A STALE COMPLETE FLAG
+	ADCSRA|=(1<<ADIE)|(1<<ADATE);     //EVERY COMPARE MATCH STARTS A SCAN
+}
+
+void AttachADCFilter(uint8_t slot, FILTER *f)
+{
+	uint8_t sreg = SREG;
+
+	if(slot >= ADC_MAXCHANNELS) return;
+
+	cli();
+	Filter[slot] = f;
+	SREG = sreg;
+}
+
+uint16_t LatestADC(uint8_t slot)
+{
+	uint16_t value;
+	uint8_t sreg = SREG;
+
+	cli();
+	value = Sample[Front][slot];
+	SREG = sreg;
+	return value;
+}
+
+void CopyADCScan(uint16_t *values)
+{
+	uint8_t i;
+	uint8_t sreg = SREG;
+
+	cli();
+	for(i = 0; i < Count; i++){
+		values[i] = Sample[Front][i];
+	}
+	SREG = sreg;
+}
+
+void WaitADCScan(void)
+{
+	uint8_t seen = Scans;
+	uint8_t sreg = SREG;
+
+	cli();
+	Waiters++;
+	SREG = sreg;
+
+	/* A broadcast latched before an earlier scan only costs one more pass */
+	while(Scans == seen){
+		Event_Wait(ScanEvent);
+	}
+
+	cli();
+	Waiters--;
+	SREG = sreg;
 }
\ No newline at end of file
@@ -2,9 +2,29 @@
 #define ADC_H_
 
 #include <avr/io.h>
+#include "filter.h"
+
+#define ADC_MAXCHANNELS 8
+#define ADC_SCANMSEC    10   // one scan of the channel list every 10 ms, at most 16
 
 void InitADC(void);
 
+// Single polled conversion, do not mix with a running scan
 uint16_t readadc(uint8_t ch);
 
+// Convert the channel list every ADC_SCANMSEC from the ADC interrupt, paced by Timer0, call from a task
+void StartADCScan(const uint8_t *channels, uint8_t count);
+
+// Run every sample of slot through f inside the ISR, NULL detaches
+void AttachADCFilter(uint8_t slot, FILTER *f);
+
+// Result for position slot of the channel list from the last complete scan
+uint16_t LatestADC(uint8_t slot);
+
+// Copy the whole last complete scan, values must hold one entry per channel
+void CopyADCScan(uint16_t *values);
+
+// Block until a scan completes after the call, any number of tasks may wait
+void WaitADCScan(void);
+
 #endif /* ADC_H_ */
\ No newline at end of file
@@ -1,4 +1,3 @@
-#define AVERAGE_RUN 10
 #define F_CPU 16000000UL
 
 #include "os.h"
@@ -7,85 +6,70 @@
 #include <stdio.h>
 #include "adc.h"
 #include "uart.h"
+#include "packet.h"
 #include <string.h>
 
-volatile int poll_count  = 0;
-
-volatile int VRx_avg[10] = {0,0,0,0,0,0,0,0,0,0};
-volatile int VRy_avg[10] = {0,0,0,0,0,0,0,0,0,0};
-volatile int LS_avg[10]  = {0,0,0,0,0,0,0,0,0,0};
- 
 volatile int servo_x       = 2;
 volatile int servo_y       = 3;
 volatile int laser_val     = 4;
 
+uint8_t bt_seq = 0;
 
-int read(int pin, int avg[]) {
-  avg[poll_count] = readadc(pin);
-  int sum = 0;
-  int i   = 0;
-  for(i = 0; i < AVERAGE_RUN; i++){
-    sum += avg[i];
-  }
-  return (sum/AVERAGE_RUN);
-}
+void read_joystick();
+void write_bt();
 
+// A packet goes out every 200 ms, built from the values read one tick before
+#define PIPELINE_PERIOD  (200 / MSECPERTICK)
 
-void read_joystick(){
-  servo_x = readadc(0);
-  servo_y = readadc(1);
-  laser_val = readadc(2);
- 
-  poll_count++;
-  if(poll_count == AVERAGE_RUN){
-    poll_count = 0;
-  }
+const SLOT pipeline[2] = {
+  {0, read_joystick},
+  {1, write_bt}
+};
 
-  Event_Signal(Task_GetArg());
-  Task_Terminate();
-}
+// Joystick x, joystick y and laser button, in scan slot order
+const uint8_t joystick_channels[3] = {0, 1, 2};
 
+// Smooth the stick axes and ignore jitter around the last value sent
+FILTER servo_x_filter;
+FILTER servo_y_filter;
+FILTER laser_filter;
 
-void write_bt(){
-  char servo_x_str[10];
-  char servo_y_str[10];
-  char laser_val_str[10];
-
-  // Weird issue where servo x is garbage when first read in, thus read in twice
-  sprintf(servo_x_str, "%d", servo_x);
-  sprintf(servo_x_str, "%d", servo_x);
-  sprintf(servo_y_str, "%d", servo_y);
-  sprintf(laser_val_str, "%d", laser_val);
-
-  // Send formatted packet
-  uart1_sendbyte('#');
-  uart1_sendstr(&servo_x_str[0]);
-  uart1_sendbyte(0x00);
-  uart1_sendstr(&servo_y_str[0]);
-  uart1_sendbyte(0x00);
-  uart1_sendstr(&laser_val_str[0]);
-  uart1_sendbyte('#');
-
-  Event_Signal(Task_GetArg());
-  Task_Terminate();
-}
 
-void action(){
-  int read_joystick_eid = Event_Init();
-  int write_bt_eid      = Event_Init();
+void read_joystick(){
+  uint16_t scan[3];
+
+  CopyADCScan(scan);
+  servo_x = scan[0];
+  servo_y = scan[1];
+  laser_val = scan[2];
+}
 
-  for(;;){
-    Task_Create(read_joystick, 2, read_joystick_eid);
-    Event_Wait(read_joystick_eid);
 
-    Task_Create(write_bt, 2, write_bt_eid);
-    Event_Wait(write_bt_eid);
-    _delay_ms(200);
+void write_bt(){
+  PACKET packet;
+  uint8_t frame[PACKET_SIZE];
+  uint8_t i;
+
+  packet.seq   = bt_seq++;
+  packet.x     = servo_x;
+  packet.y     = servo_y;
+  packet.laser = laser_val < 100;   // button pulls the pin low
+
+  Packet_Encode(&packet, frame);
+  for(i = 0; i < PACKET_SIZE; i++){
+    uart1_sendbyte(frame[i]);
   }
 }
 
 void a_main(){
   InitADC();
+  Filter_Init(&servo_x_filter, 8, 2, 4);
+  Filter_Init(&servo_y_filter, 8, 2, 4);
+  Filter_Init(&laser_filter, 4, 0, 0);
+  AttachADCFilter(0, &servo_x_filter);
+  AttachADCFilter(1, &servo_y_filter);
+  AttachADCFilter(2, &laser_filter);
+  StartADCScan(joystick_channels, 3);
 
   // Initialize Uart 1 which is used for bluetooth
   uart0_init();
@@ -94,6 +78,6 @@ void a_main(){
   uart1_init();
   _delay_ms(100);  
 
-  Task_Create(action, 1, 0);
+  Cyclic_Start(pipeline, 2, PIPELINE_PERIOD, 1, ISRSTACK + 64);
   Task_Terminate();
 }
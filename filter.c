@@ -0,0 +1,61 @@
+#include "filter.h"
+
+void Filter_Init(FILTER *f, uint8_t window, uint8_t emaShift, uint16_t deadband)
+{
+	uint8_t i;
+
+	if(window > FILTER_MAXWINDOW) window = FILTER_MAXWINDOW;
+	if(emaShift > 6) emaShift = 6;    //keeps the scaled 10-bit state in 16 bits
+
+	f->windowShift = 0;
+	while((2 << f->windowShift) <= window) f->windowShift++;
+	f->window = (window == 0) ? 0 : (1 << f->windowShift);
+
+	f->emaShift = emaShift;
+	f->deadband = deadband;
+
+	for(i = 0; i < FILTER_MAXWINDOW; i++) f->history[i] = 0;
+	f->pos = 0;
+	f->sum = 0;
+	f->ema = 0;
+	f->primed = 0;
+	f->out = 0;
+}
+
+uint16_t Filter_Update(FILTER *f, uint16_t x)
+{
+	uint8_t i;
+
+	/* The first sample seeds every stage so the output starts at the input */
+	if(!f->primed){
+		for(i = 0; i < f->window; i++) f->history[i] = x;
+		f->sum = x << f->windowShift;
+		f->ema = x << f->emaShift;
+		f->out = x;
+		f->primed = 1;
+		return x;
+	}
+
+	/* Running sum, drop the oldest sample and add the newest */
+	if(f->window > 1){
+		f->sum += x - f->history[f->pos];
+		f->history[f->pos] = x;
+		f->pos = (f->pos + 1) & (f->window - 1);
+		x = f->sum >> f->windowShift;
+	}
+
+	if(f->emaShift){
+		f->ema += x - (f->ema >> f->emaShift);
+		x = f->ema >> f->emaShift;
+	}
+
+	if(f->deadband){
+		if((x > f->out + f->deadband) || (x + f->deadband < f->out)){
+			f->out = x;
+		}
+	}else{
+		f->out = x;
+	}
+
+	return f->out;
+}
@@ -0,0 +1,32 @@
+#ifndef FILTER_H_
+#define FILTER_H_
+
+#include <stdint.h>
+
+#define FILTER_MAXWINDOW 16     // longest moving average, must be a power of two
+
+/*
+ * A filter runs up to three stages on each sample, in order: moving
+ * average, exponential smoothing and deadband. A stage set to 0 is skipped.
+ * Samples are expected to be 10-bit ADC readings.
+ */
+typedef struct {
+	uint8_t window;             // moving average length, rounded down to a power of two
+	uint8_t windowShift;
+	uint8_t emaShift;           // smoothing weight is 1/2^emaShift, at most 6
+	uint16_t deadband;          // output only moves when the input leaves this band
+
+	uint16_t history[FILTER_MAXWINDOW];
+	uint8_t pos;
+	uint16_t sum;
+	uint16_t ema;               // smoothed value scaled by 2^emaShift
+	uint8_t primed;
+	uint16_t out;
+} FILTER;
+
+void Filter_Init(FILTER *f, uint8_t window, uint8_t emaShift, uint16_t deadband);
+
+// Push one sample and return the filtered value, O(1)
+uint16_t Filter_Update(FILTER *f, uint16_t sample);
+
+#endif /* FILTER_H_ */
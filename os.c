@@ -1,6 +1,8 @@
 #include <string.h>
+#include <stdlib.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
 #include "LED_Test.h"
 #include "os.h"
 #include "queue.h"
@@ -8,6 +10,37 @@
 //Comment out the following line to remove debugging code from compiled version.
 #define DEBUG
 
+//Comment out the following line to keep Timer1 ticking while the idle task runs.
+#define TICKLESS
+
+//Comment out the following line to service every system call on the kernel stack.
+#define DIRECT_SYSCALLS
+
+//Comment out the following line to admit periodic tasks that fail the schedulability test.
+#define ADMISSION
+
+/** Ceiling of a mutex that uses priority inheritance instead */
+#define NOCEILING     0xFFFF
+
+/** Timer1 counts per tick with the 256 prescaler */
+#define TICKCOUNT     ((16000000UL / 256) * MSECPERTICK / 1000)
+
+/** Longest stretched Timer1 period in ticks, one tick of headroom is left in OCR1A */
+#define MAXTICKLESS   ((0xFFFFUL / TICKCOUNT) - 1)
+
+/** Timer1 counts Kernel_Exit_Tickless() may take from reading TCNT1 to writing OCR1A, about 300 cycles */
+#define EXITMARGIN    4
+
+/** Timer1 counts of a full frame save and restore, 314 cycles (see cswitch.S) */
+#define FRAMECOST     2
+
+/** Timer1 counts charged for the tick ISR and a context switch until longer ones are measured */
+#define TICKCOST      4
+#define SWITCHCOST    6
+
+/** Timer1 counts taken out of a window of r counts by work costing c every t counts */
+#define INTERFERENCE(r, c, t)   ((((r) + (t) - 1) / (t)) * (c))
+
 extern void a_main();
 
 /*===========
@@ -36,19 +69,49 @@ extern void Exit_Kernel();    /* this is the same as CSwitch() */
   */
 void Task_Terminate(void);
 static void Dispatch();
-static void Kernel_Unlock_Mutex();
+static void Kernel_Make_Ready(volatile PD *p);
+static void Kernel_Update_Priority(volatile PD *p);
 
 /** 
   * Contained in cswitch.S, context switches to the kernel
   */ 
 extern void Enter_Kernel();
 
+/**
+  * Contained in cswitch.S, the body of the Timer1 ISR. Saves a full frame
+  * and calls Kernel_Tick(), entering the kernel only if that asks for it.
+  */
+extern void Enter_Kernel_Preempt();
+
+/** Size in bytes of the light frame saved by Enter_Kernel(): r2-r17, r28, r29 and SREG */
+#define LIGHTFRAME    19
+
+/** Every unused stack byte holds STACKPAINT */
+#define STACKPAINT    0xA5
+
+/** The lowest STACKGUARD bytes of every stack hold STACKCANARY */
+#define STACKCANARY   0x5A
+#define STACKGUARD    4
+
 /**
   * This table contains ALL process descriptors. It doesn't matter what
   * state a task is in.
   */
 static PD Process[MAXTHREAD];
 
+/**
+  * Every task stack is carved out of this arena. Free space is kept in an
+  * address ordered list of blocks, each starting with a STACKBLK header,
+  * and neighbouring blocks are merged when a stack is given back.
+  */
+typedef struct StackBlock {
+	unsigned int size;
+	struct StackBlock *next;
+} STACKBLK;
+
+static unsigned char StackArena[STACKARENA];
+static STACKBLK *FreeStacks;
+
 /**
   * This table contains ALL mutexes. It doesn't matter what
   * state a mutex is in.
@@ -61,11 +124,32 @@ static MTX Mutex[MAXMUTEX];
   */
 static EVT Event[MAXEVENT];
 
+/**
+  * This table contains ALL semaphores, a semaphore is unused while s is 0.
+  */
+static SEM Sem[MAXSEM];
+
+/**
+  * This table contains ALL event groups, a group is unused while g is 0.
+  */
+static EVG Group[MAXGROUP];
+
+/**
+  * This table contains ALL message queues, a queue is unused while q is 0.
+  */
+static MQ Queue[MAXQUEUE];
+
 /**
   * The process descriptor of the currently RUNNING task.
   */
 volatile static PD* Cp; 
 
+/**
+  * The built-in idle task, always READY at IDLEPRIORITY so the ReadyQueue
+  * is never empty.
+  */
+volatile static PD* IdleTask;
+
 /** 
   * Since this is a "full-served" model, the kernel is executing using its own
   * stack. We can allocate a new workspace for this kernel stack, or we can
@@ -98,445 +182,1982 @@ volatile static unsigned int Mutexes;
 /** Number of events created so far */
 volatile static unsigned int Events;
 
-/** Global tick overflow count */
-volatile unsigned int tickOverflowCount = 0;
+/** Number of semaphores created so far */
+volatile static unsigned int Semaphores;
 
-/** The ReadyQueue for tasks */
-volatile PD *ReadyQueue[MAXTHREAD];
-volatile int RQCount = 0;
+/** Number of event groups created so far */
+volatile static unsigned int Groups;
 
-/** The SleepQueue for tasks */
-volatile PD *SleepQueue[MAXTHREAD];
-volatile int SQCount = 0;
+/** Number of message queues created so far */
+volatile static unsigned int Queues;
 
-/** The WaitingQueue for tasks */
-volatile PD *WaitingQueue[MAXTHREAD];
-volatile int WQCount = 0;
+/** Monotonic system time in ticks, only ever advanced by the Timer1 ISR */
+volatile static TIME SystemTick;
 
-/**
- * Sets up a task's stack with Task_Terminate() at the bottom,
- * The return address of the function
- * and dummy data to be popped off when the task first runs
- */
-PID Kernel_Create_Task_At( volatile PD *p, voidfuncptr f, PRIORITY py, int arg ) {   
-	unsigned char *sp;
+#ifdef TICKLESS
+/** Number of ticks that will be credited at the next Timer1 compare match */
+volatile static TIME TicklessSpan = 1;
 
-#ifdef DEBUG
-	int counter = 0;
+/** Ticks of the current Timer1 period that were already credited early */
+volatile static TIME TicklessBase = 0;
 #endif
 
-	sp = (unsigned char *) &(p->workSpace[WORKSPACE-1]);
+/** The cyclic executive, NULL unless Cyclic_Start() was called */
+volatile static PD *Executive = NULL;
 
-	//Clear the contents of the workspace
-	memset(&(p->workSpace),0,WORKSPACE);
+/** The schedule table it runs, CyclicSlots entries per CyclicPeriod ticks */
+static const SLOT *CyclicTable;
+static unsigned int CyclicSlots;
+static TICK CyclicPeriod;
 
-	//Notice that we are placing the address (16-bit) of the functions
-	//onto the stack in reverse byte order (least significant first, followed
-	//by most significant).  This is because the "return" assembly instructions 
-	//(rtn and rti) pop addresses off in BIG ENDIAN (most sig. first, least sig. 
-	//second), even though the AT90 is LITTLE ENDIAN machine.
-
-	//Store terminate at the bottom of stack to protect against stack underrun.
-	*(unsigned char *)sp-- = ((unsigned int)Task_Terminate) & 0xff;
-	*(unsigned char *)sp-- = (((unsigned int)Task_Terminate) >> 8) & 0xff;
+/** Next slot to release and the ticks left until then */
+volatile static unsigned int CyclicNext;
+volatile static TIME CyclicWait;
 
-	//Place return address of function at bottom of stack
-	*(unsigned char *)sp-- = ((unsigned int)f) & 0xff;
-	*(unsigned char *)sp-- = (((unsigned int)f) >> 8) & 0xff;
-	*(unsigned char *)sp-- = 0x00; // Fix 17 bit address problem for PC
+/** Slot the executive is on, and slots released behind it */
+volatile static unsigned int CyclicCurrent;
+volatile static unsigned int CyclicPending;
 
-#ifdef DEBUG
-   //Fill stack with initial values for development debugging
-   //Registers 0 -> 31 and the status register
-	for (counter = 0; counter < 34; counter++) {
-		*(unsigned char *)sp-- = counter;
-	}
-#else
-	//Place stack pointer at top of stack
-	sp = sp - 34;
-#endif
-	  
-	p->sp = sp;     /* stack pointer into the "workSpace" */
-	p->code = f;        /* function to be executed as a task */
-	p->request = NONE;
-	p->p = pCount;
-	p->py = py;
-	p->inheritedPy = py;
-	p->arg = arg;
-	p->suspended = 0;
-	p->eWait = 99;
+/** Times each slot was still running, or not yet started, at the next release */
+volatile static unsigned int CyclicOverruns[MAXSLOT];
 
-	Tasks++;
-	pCount++;
+/** Longest tick ISR and kernel pass between two tasks seen so far, in Timer1 counts */
+volatile static unsigned int TickCost = TICKCOST;
+volatile static unsigned int SwitchCost = SWITCHCOST;
 
-	p->state = READY;
+/** Called on every late or overrunning periodic job, NULL if none was set */
+static missfuncptr MissHandler = NULL;
 
-	enqueueRQ(&p, &ReadyQueue, &RQCount);
+/** The ReadyQueue for tasks, holds only READY tasks that are not suspended */
+volatile RQ ReadyQueue;
 
-	return p->p;
-}
+/** The SleepQueue for tasks, a delta list ordered by wake up time */
+volatile SQ SleepQueue;
 
 /**
-  *  Create a new task
+  * Marks a task READY and, unless it is suspended, places it on the ReadyQueue.
+  * Suspended tasks stay off the queue until Task_Resume().
   */
-static PID Kernel_Create_Task( voidfuncptr f, PRIORITY py, int arg ) {
-	int x;
-
-	if (Tasks == MAXTHREAD) return;  /* Too many task! */
+static void Kernel_Make_Ready(volatile PD *p) {
+	p->state = READY;
 
-	/* find a DEAD PD that we can use  */
-	for (x = 0; x < MAXTHREAD; x++) {
-		if (Process[x].state == DEAD) break;
+	if (p->suspended == 0) {
+		enqueueRQ(&p, &ReadyQueue);
 	}
-
-	unsigned int p = Kernel_Create_Task_At( &(Process[x]), f, py, arg );
-
-	return p;
 }
 
 /**
-  *  Suspend a task
+  * Changes the effective priority of a task, moving it to the matching
+  * ReadyQueue list if it is currently queued there.
   */
-static void Kernel_Suspend_Task() {
-	int i;
-
-	if(Cp->p == Cp->pidAction) {
-		Cp->suspended = 1;
+static void Kernel_Set_Priority(volatile PD *p, PRIORITY py) {
+	if ((p->state == READY) && (p->suspended == 0)) {
+		removeRQ(&p, &ReadyQueue);
+		p->inheritedPy = py;
+		enqueueRQ(&p, &ReadyQueue);
 	}
 	else {
-		for(i = 0; i < MAXTHREAD; i++) {
-			if (Process[i].p == Cp->pidAction) break;
-		}
-
-		if(i >= MAXTHREAD) {
-			return;
-		}
-
-		Process[i].suspended = 1;
+		p->inheritedPy = py;
 	}
 }
 
 /**
-  *  Resume a task
+  * 1 if p should run before Cp. Under EDF two tasks at EDFPRIORITY are
+  * ordered by deadline, otherwise only a more urgent priority wins.
   */
-static unsigned int Kernel_Resume_Task() {
-	int i;
-
-	for(i = 0; i < MAXTHREAD; i++) {
-		if (Process[i].p == Cp->pidAction) break;
+static unsigned int Kernel_Before(volatile PD *p) {
+#ifdef EDF
+	if ((p->inheritedPy == EDFPRIORITY) && (Cp->inheritedPy == EDFPRIORITY)) {
+		return earlierRQ(p, Cp);
 	}
+#endif
 
-	if(i >= MAXTHREAD) {
-			return 0;
-		}
+	return p->inheritedPy < Cp->inheritedPy;
+}
 
-	if(Process[i].suspended == 1) {
-		Process[i].suspended = 0;
-		if(Process[i].inheritedPy < Cp->inheritedPy) {
-			return 1;
-		}
+/**
+  * Like Kernel_Before(), except that outside the EDF level an equal
+  * priority wins as well, so that equal priorities round robin.
+  */
+static unsigned int Kernel_Not_After(volatile PD *p) {
+#ifdef EDF
+	if ((p->inheritedPy == EDFPRIORITY) && (Cp->inheritedPy == EDFPRIORITY)) {
+		return earlierRQ(p, Cp);
 	}
+#endif
 
-	return 0;
+	return p->inheritedPy <= Cp->inheritedPy;
 }
 
 /**
-  *  Terminate a task
+  * 1 if the most urgent READY task should run before Cp, by the same rule
+  * as Kernel_Before(), or Kernel_Not_After() if tie is set.
   */
-static void Kernel_Terminate_Task() {
-	Cp->inheritedPy = 0;
-	Cp->py = 0;
-	Cp->state = TERMINATED;
+static unsigned int Kernel_Ready_Before(unsigned int tie) {
+	int py = highestRQ(&ReadyQueue);
 
-	int i;
+	if (py < 0) {
+		return 0;
+	}
 
-	for(i = 0; i < MAXMUTEX; i++) {
-		if (Mutex[i].owner == Cp->p) {
-			Cp->m = Mutex[i].m;
-			Kernel_Unlock_Mutex();
-		}
+#ifdef EDF
+	/** Within the EDF level only an earlier deadline goes first */
+	if (((PRIORITY)py == EDFPRIORITY) && (Cp->inheritedPy == EDFPRIORITY)) {
+		return earlierRQ(ReadyQueue.heap[0], Cp);
 	}
+#endif
 
-	Cp->state = DEAD;
-	Cp->eWait = 99;
-	Cp->inheritedPy = MINPRIORITY;
-	Cp->py = MINPRIORITY;
-	Cp->p = 0;
-	Tasks--;
+	return ((PRIORITY)py < Cp->inheritedPy) || (tie && ((PRIORITY)py == Cp->inheritedPy));
 }
 
 /**
-  *  Initialize a mutex
+  * Returns 1 after queueing Cp if p is now READY and more urgent than Cp,
+  * i.e. Cp has to hand the CPU over to p.
   */
-MUTEX Kernel_Init_Mutex_At(volatile MTX *m) {
-	m->m = Mutexes;
-	m->state = FREE;
-	Mutexes++;
+static unsigned int Kernel_Yield_To(volatile PD *p) {
+	if ((p->state == READY) && (p->suspended == 0) && Kernel_Before(p)) {
+		Cp->state = READY;
+		enqueueRQ(&Cp, &ReadyQueue);
+		return 1;
+	}
 
-	return m->m;
+	return 0;
 }
 
 /**
-  *  Find a free mutex to initialize
+  * Blocks Cp on a wait list. Unless Cp->reqTimeout is WAIT_FOREVER, Cp is
+  * also put on the SleepQueue, and if that runs out first
+  * Kernel_Advance_Time() readies it with a response of 0.
   */
-static MUTEX Kernel_Init_Mutex() {
-	int x;
-
-	if (Mutexes == MAXMUTEX) return; // Too many mutexes!
-
-	// find a Disabled mutex that we can use
-	for (x = 0; x < MAXMUTEX; x++) {
-		if (Mutex[x].state == DISABLED) break;
+static void Kernel_Block(volatile WL *w, PROCESS_STATES state) {
+	Cp->state = state;
+	enqueueWL(&Cp, w);
+
+	if (Cp->reqTimeout != WAIT_FOREVER) {
+		Cp->delta = Cp->reqTimeout;
+		Cp->timed = 1;
+		enqueueSQ(&Cp, &SleepQueue);
 	}
-
-	unsigned int m = Kernel_Init_Mutex_At( &(Mutex[x]) );
-
-	return m;
 }
 
 /**
-  *  Lock a mutex
+  * Takes a blocked task off its wait list, cancels its timeout and readies
+  * it with the given response.
   */
-static unsigned int Kernel_Lock_Mutex() {
-	int i,j;
-	MUTEX m = Cp->m;
-
-	for(i = 0; i < MAXMUTEX; i++) {
-		if (Mutex[i].m == m) break;
-	}
-
-	if(i>=MAXMUTEX){
-		return 1;
-	}
-
-	if(Mutex[i].state == FREE) {
-		Mutex[i].state = LOCKED;
-		Mutex[i].owner = Cp->p;
-		Mutex[i].lockCount++;
-	}
-	else if (Mutex[i].owner == Cp->p) {
-		Mutex[i].lockCount++;
-	}
-	else {
-		for(j = 0; j < MAXTHREAD; j++) {
-			if ((Process[j].p == Mutex[i].owner) && (Process[j].p != 0)) break;
-		}
+static void Kernel_Unblock_Task(volatile PD *p, unsigned int response) {
+	removeWL(&p, p->waitList);
 
-		if (Process[j].inheritedPy > Cp->inheritedPy) {
-			Process[j].inheritedPy = Cp->inheritedPy;
-		}
-
-		Cp->state = BLOCKED_ON_MUTEX;
-		enqueueWQ(&Cp, &WaitingQueue, &WQCount);
-
-		return 0;
+	if (p->timed) {
+		removeSQ(&p, &SleepQueue);
+		p->timed = 0;
 	}
 
-	return 1;
+	p->response = response;
+	Kernel_Make_Ready(p);
 }
 
 /**
-  *  Unlock a task
+  * Unblocks the most urgent task on a wait list, NULL if nobody was waiting
   */
-static void Kernel_Unlock_Mutex() {
-	int i;
-	MUTEX m = Cp->m;
-
-	for(i = 0; i < MAXMUTEX; i++) {
-		if (Mutex[i].m == m) break;
-	}
+static volatile PD *Kernel_Unblock(volatile WL *w, unsigned int response) {
+	volatile PD *p = w->head;
 
-	if(i >= MAXMUTEX){
-		return;
+	if (p != NULL) {
+		Kernel_Unblock_Task(p, response);
 	}
 
-	if(Mutex[i].owner != Cp->p){
-		return;
-	} 
-	else if (Cp->state == TERMINATED) {
-		volatile PD* p = dequeueWQ(&WaitingQueue, &WQCount, m);
-		if (p == NULL) {
-			Mutex[i].lockCount = 0;
-			Mutex[i].state = FREE;
-			Mutex[i].owner = 0;
-			return;
-		}
-		else {
-			Mutex[i].lockCount = 1;
-			Mutex[i].owner = p->p;
-
-			p->inheritedPy = Cp->inheritedPy;
-			p->state = READY;
-
-			Cp->inheritedPy = Cp->py;
+	return p;
+}
 
-			Cp->state = READY;
+/**
+  * The idle task. It runs only when nothing else is READY and puts the
+  * CPU into idle sleep until the next interrupt. If that interrupt readied
+  * a task, the CPU is handed over right away instead of at the next tick.
+  */
+static void Kernel_Idle() {
+	for(;;) {
+		Disable_Interrupt();
 
-			enqueueRQ(&p, &ReadyQueue, &RQCount);
-		}
-	}
-	else if (Mutex[i].lockCount > 1) {
-		Mutex[i].lockCount--;
-	}
-	else {
-		volatile PD* p = dequeueWQ(&WaitingQueue, &WQCount, m);
-
-		if(p == NULL){
-			Mutex[i].state = FREE;
-			Mutex[i].lockCount = 0;
-			Mutex[i].owner = 0;
-			Cp->inheritedPy = Cp->py;
-
-			// Turn on pin for newly running task
-			// For testing
-			if (Cp->p <= 1) {
-				enable_LED(PORTL2);
-			}
-			else if (Cp->p == 2) {
-				enable_LED(PORTL5);
-			}
-			else if (Cp->p == 3) {
-				enable_LED(PORTL6);
-			}
+		if (ReadyQueue.bitmap == 0) {
+			set_sleep_mode(SLEEP_MODE_IDLE);
+			sleep_enable();
+			Enable_Interrupt();
+			sleep_cpu();    /* sei takes effect only after this instruction */
+			sleep_disable();
 		}
 		else {
-			Mutex[i].lockCount = 1;
-			Mutex[i].owner = p->p;
-
-			p->inheritedPy = Cp->inheritedPy;
-			p->state = READY;
-
-			Cp->inheritedPy = Cp->py;
-
-			Cp->state = READY;
-
-			enqueueRQ(&p, &ReadyQueue, &RQCount);
-			enqueueRQ(&Cp, &ReadyQueue, &RQCount);
-			Dispatch();
+			Enable_Interrupt();
+			Task_Next();
 		}
 	}
 }
 
+/** Why and for which task the kernel gave up, for inspection with a debugger */
+volatile ABORT_REASON AbortReason = ABORT_NONE;
+volatile PID AbortPid;
+
 /**
-  *  Initialize an event
+  * Records a diagnostic, lights the LED on pin 49 and stops the system.
   */
-EVENT Kernel_Init_Event_At(volatile EVT *e) {
-	e->e = Events;
-	e->state = UNSIGNALLED;
-	e->p = NULL;
+static void Kernel_Abort(ABORT_REASON reason, PID p) {
+	Disable_Interrupt();
 
-	Events++;
+	AbortReason = reason;
+	AbortPid = p;
 
-	return e->e;
+	enable_LED(PORTL0);
+
+	OS_Abort();
 }
 
 /**
-  *  Find an event to initialize
+  * Aborts if a task's stack pointer has run into its guard bytes or the
+  * canary below its stack was overwritten. Called on every switch away
+  * from a task, and on every tick for the task it interrupted.
   */
-static EVENT Kernel_Init_Event() {
-	int x;
-
-	if (Events == MAXEVENT) return; // Too many mutexes!
+static void Kernel_Check_Stack(volatile PD *p) {
+	int i;
 
-	// find a Disabled mutex that we can use
-	for (x = 0; x < MAXEVENT; x++) {
-		if (Event[x].state == INACTIVE) break;
+	if (p->sp < p->workSpace + STACKGUARD) {
+		Kernel_Abort(ABORT_STACK_OVERFLOW, p->p);
 	}
 
-	unsigned int e = Kernel_Init_Event_At( &(Event[x]) );
-
-	return e;
+	for (i = 0; i < STACKGUARD; i++) {
+		if (p->workSpace[i] != STACKCANARY) {
+			Kernel_Abort(ABORT_STACK_OVERFLOW, p->p);
+		}
+	}
 }
 
 /**
-  *  Wait on an event
+  * Takes a stack of at least *size bytes from the arena, first fit. The
+  * actual size is written back to *size. Returns NULL if nothing fits.
   */
-static unsigned int Kernel_Wait_Event() {
-	int i;
-	unsigned int e = Cp->eSend;
+static unsigned char *Kernel_Alloc_Stack(unsigned int *size) {
+	STACKBLK *prev = NULL;
+	STACKBLK *blk = FreeStacks;
 
-	for (i = 0; i < MAXEVENT; i++) {
-		if (Event[i].e == e) break;
+	if (*size < MINSTACK) {
+		*size = MINSTACK;
 	}
 
-	if (i >= MAXEVENT) {
-		return 0;
+	while ((blk != NULL) && (blk->size < *size)) {
+		prev = blk;
+		blk = blk->next;
 	}
 
-	if (Event[i].p == NULL) {
-		if (Event[i].state == SIGNALLED) {
-			Event[i].state = UNSIGNALLED;
-			return 0;
+	if (blk == NULL) {
+		return NULL;
+	}
+
+	/** Hand out the whole block rather than leave an unusable sliver */
+	if (blk->size - *size < MINSTACK) {
+		*size = blk->size;
+
+		if (prev == NULL) {
+			FreeStacks = blk->next;
 		}
 		else {
-			Cp->eWait = e;
-			Event[i].p = Cp->p;
-			return 1;
+			prev->next = blk->next;
 		}
+
+		return (unsigned char *)blk;
 	}
 
-	return 0;
+	/** Otherwise take the top end, so the free block stays where it is */
+	blk->size -= *size;
+
+	return (unsigned char *)blk + blk->size;
 }
 
 /**
-  *  Signal an event
+  * Gives a stack back to the arena, merging it with free neighbours.
   */
-static void Kernel_Signal_Event() {
-	int i, j;
-	unsigned int e = Cp->eSend;
-
-	for (i = 0; i < MAXEVENT; i++) {
-		if (Event[i].e == e) break;
+static void Kernel_Free_Stack(unsigned char *stack, unsigned int size) {
+	STACKBLK *blk = (STACKBLK *)stack;
+	STACKBLK *prev = NULL;
+	STACKBLK *next = FreeStacks;
+
+	while ((next != NULL) && ((unsigned char *)next < stack)) {
+		prev = next;
+		next = next->next;
 	}
 
-	if (i >= MAXEVENT) {
-		return;
-	}
+	blk->size = size;
+	blk->next = next;
 
-	for(j = 0; j < MAXTHREAD; j++) {
-		if (Process[j].eWait == e) break;
+	if ((next != NULL) && (stack + size == (unsigned char *)next)) {
+		blk->size += next->size;
+		blk->next = next->next;
 	}
 
-	if (j >= MAXTHREAD) {
-		Event[i].state = SIGNALLED;
+	if (prev == NULL) {
+		FreeStacks = blk;
+	}
+	else if ((unsigned char *)prev + prev->size == stack) {
+		prev->size += blk->size;
+		prev->next = blk->next;
 	}
 	else {
-		Process[j].state = READY;
-		Process[j].eWait = 99;
-
-		Event[i].p = NULL;
-
-		if ((Process[j].inheritedPy < Cp->inheritedPy) && (Process[j].suspended == 0)) {
-			Cp->state = READY;
-			enqueueRQ(&Cp, &ReadyQueue, &RQCount);
-			Dispatch();
-		}
+		prev->next = blk;
 	}
 }
 
 /**
-  * This internal kernel function is the "scheduler". It chooses the 
-  * next task to run, i.e., Cp.
+ * Sets up a task's stack with Task_Terminate() at the bottom,
+ * The return address of the function
+ * and dummy data to be popped off when the task first runs
+ */
+PID Kernel_Create_Task_At( volatile PD *p, voidfuncptr f, PRIORITY py, int arg, unsigned int stackSize ) {   
+	unsigned char *sp;
+	int counter = 0;
+
+	p->workSpace = Kernel_Alloc_Stack(&stackSize);
+
+	if (p->workSpace == NULL) {
+		return 0;   /* the stack arena is exhausted */
+	}
+
+	p->stackSize = stackSize;
+
+	sp = (unsigned char *) &(p->workSpace[stackSize-1]);
+
+	//Paint the workspace so Task_StackHighWater() can tell which bytes were
+	//ever used, and put the canary below it for Kernel_Check_Stack()
+	memset(p->workSpace,STACKPAINT,stackSize);
+	memset(p->workSpace,STACKCANARY,STACKGUARD);
+
+	//Notice that we are placing the address (16-bit) of the functions
+	//onto the stack in reverse byte order (least significant first, followed
+	//by most significant).  This is because the "return" assembly instructions 
+	//(rtn and rti) pop addresses off in BIG ENDIAN (most sig. first, least sig. 
+	//second), even though the AT90 is LITTLE ENDIAN machine.
+
+	//Store terminate at the bottom of stack to protect against stack underrun.
+	//It is the return address of f, so it needs all three PC bytes as well.
+	*(unsigned char *)sp-- = ((unsigned int)Task_Terminate) & 0xff;
+	*(unsigned char *)sp-- = (((unsigned int)Task_Terminate) >> 8) & 0xff;
+	*(unsigned char *)sp-- = 0x00;
+
+	//Place return address of function at bottom of stack
+	*(unsigned char *)sp-- = ((unsigned int)f) & 0xff;
+	*(unsigned char *)sp-- = (((unsigned int)f) >> 8) & 0xff;
+	*(unsigned char *)sp-- = 0x00; // Fix 17 bit address problem for PC
+
+	//A new task starts from a light frame, as if it had called Enter_Kernel().
+	//Registers 2 -> 17, 28, 29 and the status register
+	for (counter = 0; counter < LIGHTFRAME; counter++) {
+#ifdef DEBUG
+		//Fill stack with initial values for development debugging
+		*(unsigned char *)sp-- = counter;
+#else
+		//SREG in particular must start out with interrupts disabled
+		*(unsigned char *)sp-- = 0x00;
+#endif
+	}
+
+	//Frame tag read by Exit_Kernel(), 0 is a light frame
+	*(unsigned char *)sp-- = 0x00;
+	  
+	p->sp = sp;     /* stack pointer into the "workSpace" */
+	p->code = f;        /* function to be executed as a task */
+	p->request = NONE;
+	p->p = pCount;
+	p->py = py;
+	p->inheritedPy = py;
+	p->arg = arg;
+	p->suspended = 0;
+	p->period = 0;
+
+	Tasks++;
+	pCount++;
+
+	p->state = READY;
+
+	enqueueRQ(&p, &ReadyQueue);
+
+	return p->p;
+}
+
+/**
+  *  Create a new task
+  */
+static PID Kernel_Create_Task( voidfuncptr f, PRIORITY py, int arg, unsigned int stackSize ) {
+	int x;
+
+	if (Tasks == MAXTHREAD) return 0;  /* Too many task! */
+
+	if (py > MINPRIORITY) {
+		py = MINPRIORITY;
+	}
+
+	/* find a DEAD PD that we can use  */
+	for (x = 0; x < MAXTHREAD; x++) {
+		if (Process[x].state == DEAD) break;
+	}
+
+	unsigned int p = Kernel_Create_Task_At( &(Process[x]), f, py, arg, stackSize );
+
+	return p;
+}
+
+/**
+  *  Find the PD of a live task, NULL if there is none
+  */
+static volatile PD *Kernel_Find_Task(PID p) {
+	int i;
+
+	for (i = 0; i < MAXTHREAD; i++) {
+		if ((Process[i].p == p) && (Process[i].state != DEAD)) {
+			return &Process[i];
+		}
+	}
+
+	return NULL;
+}
+
+/**
+  * Body of every worker task: run the job it was armed with, then park
+  * until Task_Rearm() hands it the next one.
+  */
+static void Kernel_Worker() {
+	for(;;) {
+		Cp->code();
+
+		Disable_Interrupt();
+		Cp->request = PARK;
+		Enter_Kernel();
+	}
+}
+
+/**
+  *  Create a worker task that starts out PARKED
+  */
+static PID Kernel_Create_Worker( PRIORITY py, unsigned int stackSize ) {
+	PID pid = Kernel_Create_Task( Kernel_Worker, py, 0, stackSize );
+	volatile PD *p;
+
+	if (pid == 0) {
+		return 0;
+	}
+
+	p = Kernel_Find_Task(pid);
+
+	removeRQ(&p, &ReadyQueue);
+	p->state = PARKED;
+
+	return pid;
+}
+
+/**
+  * Cost of one periodic job in Timer1 counts: its wcet plus the switch to
+  * it when it is released and the switch away when it finishes
+  */
+static unsigned long Kernel_Job_Cost(TICK wcet) {
+	return (wcet * TICKCOUNT) + (2 * (unsigned long)SwitchCost);
+}
+
+/**
+  * Share of the CPU, in per mille and rounded up, taken by c counts of work
+  * every t counts
+  */
+static unsigned int Kernel_Permille(unsigned long c, unsigned long t) {
+	unsigned int u = (c / t) * 1000;
+
+	c %= t;
+
+	/** Lose low bits of both until c * 1000 fits in 32 bits */
+	while (c > 4000000UL) {
+		c >>= 1;
+		t >>= 1;
+	}
+
+	return u + (((c * 1000) + t - 1) / t);
+}
+
+/**
+  * Per mille of the CPU the tick ISR and the periodic tasks need. The
+  * cyclic executive and tasks that are not periodic are not counted.
+  */
+static unsigned int Kernel_Utilisation() {
+	unsigned int u = Kernel_Permille(TickCost, TICKCOUNT);
+	int x;
+
+	for (x = 0; x < MAXTHREAD; x++) {
+		volatile PD *p = &Process[x];
+
+		if ((p->state != DEAD) && (p->period > 0)) {
+			u += Kernel_Permille(Kernel_Job_Cost(p->wcet), p->period * TICKCOUNT);
+		}
+	}
+
+	return u;
+}
+
+#ifndef EDF
+/**
+  * Response time analysis: worst case response, in Timer1 counts, of a job
+  * of wcet ticks at priority py. It is held up by the tick ISR, by every
+  * other periodic task (not self) of priority py or above, round robin
+  * included, and by a task of priority apy being admitted (aperiod 0 if
+  * none). Gives up as soon as the response passes the end of the period.
+  */
+static unsigned long Kernel_Response(PRIORITY py, TICK period, TICK wcet, volatile PD *self, PRIORITY apy, TICK aperiod, TICK awcet) {
+	unsigned long c = Kernel_Job_Cost(wcet);
+	unsigned long d = period * TICKCOUNT;
+	unsigned long r = c;
+	unsigned long next;
+	int x;
+
+	for(;;) {
+		next = c + INTERFERENCE(r, TickCost, TICKCOUNT);
+
+		for (x = 0; x < MAXTHREAD; x++) {
+			volatile PD *p = &Process[x];
+
+			if ((p != self) && (p->state != DEAD) && (p->period > 0) && (p->py <= py)) {
+				next += INTERFERENCE(r, Kernel_Job_Cost(p->wcet), p->period * TICKCOUNT);
+			}
+		}
+
+		if ((aperiod > 0) && (apy <= py)) {
+			next += INTERFERENCE(r, Kernel_Job_Cost(awcet), aperiod * TICKCOUNT);
+		}
+
+		if ((next == r) || (next > d)) {
+			return next;
+		}
+
+		r = next;
+	}
+}
+#endif
+
+/**
+  * Admission test for a periodic task of priority py. Returns 1 if it and
+  * every periodic task already running still finish each job by the end of
+  * its period. Under EDF that holds while the utilisation stays within
+  * 1000 per mille; under fixed priorities the new task and every task of
+  * its priority or lower are put through response time analysis.
+  */
+static unsigned int Kernel_Admit(PRIORITY py, TICK period, TICK wcet) {
+#ifdef EDF
+	return (Kernel_Utilisation() + Kernel_Permille(Kernel_Job_Cost(wcet), period * TICKCOUNT)) <= 1000;
+#else
+	int x;
+
+	if (Kernel_Response(py, period, wcet, NULL, 0, 0, 0) > period * TICKCOUNT) {
+		return 0;
+	}
+
+	/** Only tasks it can preempt, or share a level with, get slower */
+	for (x = 0; x < MAXTHREAD; x++) {
+		volatile PD *p = &Process[x];
+
+		if ((p->state == DEAD) || (p->period == 0) || (p->py < py)) {
+			continue;
+		}
+
+		if (Kernel_Response(p->py, p->period, p->wcet, p, py, period, wcet) > p->period * TICKCOUNT) {
+			return 0;
+		}
+	}
+
+	return 1;
+#endif
+}
+
+/**
+  * Body of every periodic task: run one job per period. NEXT_PERIOD moves
+  * the release on by exactly one period from the previous release, never
+  * from the time the job finished, so the schedule does not drift.
+  */
+static void Kernel_Periodic() {
+	for(;;) {
+		Cp->code();
+
+		Disable_Interrupt();
+		Cp->request = NEXT_PERIOD;
+		Enter_Kernel();
+	}
+}
+
+/**
+  *  Create a periodic task, its first job is released offset ticks from now.
+  *  Returns 0 if the task set would no longer be schedulable with it.
+  */
+static PID Kernel_Create_Periodic( voidfuncptr f, PRIORITY py, int arg, TICK period, TICK wcet, TICK offset, unsigned int stackSize ) {
+	PID pid;
+	volatile PD *p;
+
+	/** A job longer than its period can never finish in time */
+	if ((period == 0) || (wcet > period)) {
+		return 0;
+	}
+
+#ifdef EDF
+	/** Periodic tasks share one level and are picked by deadline there */
+	py = EDFPRIORITY;
+#endif
+
+#ifdef ADMISSION
+	if (!Kernel_Admit(py, period, wcet)) {
+		return 0;
+	}
+#endif
+
+	pid = Kernel_Create_Task( Kernel_Periodic, py, arg, stackSize );
+
+	if (pid == 0) {
+		return 0;
+	}
+
+	p = Kernel_Find_Task(pid);
+
+	/** Take it off the ReadyQueue until its deadline is known */
+	removeRQ(&p, &ReadyQueue);
+
+	p->code = f;
+	p->period = period;
+	p->wcet = wcet;
+	p->release = SystemTick + offset;
+	p->deadline = p->release + period;
+	p->started = 0;
+	p->used = 0;
+	p->late = 0;
+	memset((void *)&p->stats, 0, sizeof(JOBSTATS));
+
+	if (offset > 0) {
+		p->state = SLEEPING;
+		p->delta = offset;
+		enqueueSQ(&p, &SleepQueue);
+	}
+	else {
+		enqueueRQ(&p, &ReadyQueue);
+	}
+
+	return pid;
+}
+
+/**
+  *  Counts a fault of p's current job and, if the miss handler asks for
+  *  it, demotes p to MINPRIORITY for good
+  */
+static void Kernel_Job_Fault(volatile PD *p, unsigned int kind) {
+	if (kind == JOB_LATE) {
+		p->stats.misses++;
+	}
+	else {
+		p->stats.overruns++;
+	}
+
+	if ((MissHandler != NULL) && MissHandler(p->p, kind) && (p->py < MINPRIORITY)) {
+		p->py = MINPRIORITY;
+		Kernel_Update_Priority(p);
+	}
+}
+
+/**
+  *  Counts Cp's job as late, once, if it is still not done at the end of
+  *  its period
+  */
+static void Kernel_Check_Late() {
+	if (!Cp->late && !TIME_BEFORE(SystemTick, Cp->deadline)) {
+		Cp->late = 1;
+		Kernel_Job_Fault(Cp, JOB_LATE);
+	}
+}
+
+/**
+  *  Charges the current tick to Cp's job. Only the running job is looked
+  *  at, so the tick stays constant work and the miss handler never runs
+  *  on the stack of an unrelated task. A job that is kept from running
+  *  past its deadline is counted when it next runs or finishes.
+  */
+static void Kernel_Check_Job() {
+	if (Cp->period == 0) {
+		return;
+	}
+
+	if ((Cp->used <= Cp->wcet) && (++Cp->used > Cp->wcet)) {
+		Kernel_Job_Fault(Cp, JOB_OVERRUN);
+	}
+
+	Kernel_Check_Late();
+}
+
+/**
+  *  Records the job Cp just finished and moves it on to its next period
+  */
+static void Kernel_Finish_Job() {
+	Kernel_Check_Late();
+
+	Cp->stats.release = Cp->release;
+	Cp->stats.start = Cp->start;
+	Cp->stats.finish = SystemTick;
+
+	Cp->started = 0;
+	Cp->used = 0;
+	Cp->late = 0;
+
+	Cp->release += Cp->period;
+	Cp->deadline = Cp->release + Cp->period;
+	Cp->wakeTime = Cp->release;
+}
+
+/**
+  *  Hand a parked worker a new job, returns 1 if Cp has to hand the CPU to it
+  */
+static unsigned int Kernel_Rearm_Worker() {
+	volatile PD *p = Kernel_Find_Task(Cp->pidAction);
+
+	if ((p == NULL) || (p->state != PARKED)) {
+		Cp->response = 0;
+		return 0;
+	}
+
+	p->code = Cp->reqCode;
+	p->arg = Cp->reqArg;
+	Kernel_Make_Ready(p);
+
+	Cp->response = 1;
+
+	return Kernel_Yield_To(p);
+}
+
+/**
+  *  Suspend a task
+  */
+static void Kernel_Suspend_Task() {
+	int i;
+
+	if(Cp->p == Cp->pidAction) {
+		Cp->suspended = 1;
+	}
+	else {
+		for(i = 0; i < MAXTHREAD; i++) {
+			if (Process[i].p == Cp->pidAction) break;
+		}
+
+		if((i >= MAXTHREAD) || (&Process[i] == IdleTask)) {
+			return;
+		}
+
+		if((Process[i].state == READY) && (Process[i].suspended == 0)) {
+			volatile PD *p = &Process[i];
+			removeRQ(&p, &ReadyQueue);
+		}
+
+		Process[i].suspended = 1;
+	}
+}
+
+/**
+  *  Resume a task
+  */
+static unsigned int Kernel_Resume_Task() {
+	int i;
+
+	for(i = 0; i < MAXTHREAD; i++) {
+		if (Process[i].p == Cp->pidAction) break;
+	}
+
+	if(i >= MAXTHREAD) {
+			return 0;
+		}
+
+	if(Process[i].suspended == 1) {
+		Process[i].suspended = 0;
+
+		if(Process[i].state != READY) {
+			return 0;
+		}
+
+		volatile PD *p = &Process[i];
+		enqueueRQ(&p, &ReadyQueue);
+
+		if(Kernel_Before(p)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+  *  The most urgent of a task's own priority, the ceiling of every mutex it
+  *  holds and the priority of the first waiter on each of them
+  */
+static PRIORITY Kernel_Inherited_Priority(volatile PD *p) {
+	PRIORITY py = p->py;
+	volatile MTX *m;
+
+	for (m = p->held; m != NULL; m = m->nextHeld) {
+		if (m->ceiling < py) {
+			py = m->ceiling;
+		}
+
+		if ((m->waiters.head != NULL) && (m->waiters.head->inheritedPy < py)) {
+			py = m->waiters.head->inheritedPy;
+		}
+	}
+
+	return py;
+}
+
+/**
+  *  Recomputes a task's inherited priority and carries the change along
+  *  the blocking chain: a task that is itself waiting is re-sorted in its
+  *  wait list, and the owner of the mutex it waits on is updated in turn.
+  */
+static void Kernel_Update_Priority(volatile PD *p) {
+	volatile WL *w;
+	PRIORITY py;
+
+	while (p != NULL) {
+		py = Kernel_Inherited_Priority(p);
+
+		if (py == p->inheritedPy) {
+			break;
+		}
+
+		if (p->waitList != NULL) {
+			w = p->waitList;
+			removeWL(&p, w);
+			p->inheritedPy = py;
+			enqueueWL(&p, w);
+		}
+		else {
+			Kernel_Set_Priority(p, py);
+		}
+
+		p = (p->blockedOn != NULL) ? p->blockedOn->holder : NULL;
+	}
+}
+
+/**
+  *  Makes p the owner of a mutex
+  */
+static void Kernel_Take_Mutex(volatile MTX *m, volatile PD *p) {
+	m->owner = p->p;
+	m->holder = p;
+	m->nextHeld = p->held;
+	p->held = m;
+}
+
+/**
+  *  Takes a mutex away from its owner and passes it to the most urgent
+  *  waiter, or frees it. Both tasks' priorities are recomputed from the
+  *  mutexes they hold afterwards. Returns the new owner, NULL if none.
+  */
+static volatile PD *Kernel_Release_Mutex(volatile MTX *m) {
+	volatile PD *owner = m->holder;
+	volatile MTX * volatile *link = &owner->held;
+	volatile PD *p;
+
+	while (*link != m) {
+		link = &((*link)->nextHeld);
+	}
+
+	*link = m->nextHeld;
+	m->nextHeld = NULL;
+
+	p = Kernel_Unblock(&m->waiters, 1);
+
+	if (p == NULL) {
+		m->state = FREE;
+		m->lockCount = 0;
+		m->owner = 0;
+		m->holder = NULL;
+	}
+	else {
+		p->blockedOn = NULL;
+		m->lockCount = 1;
+		Kernel_Take_Mutex(m, p);
+		Kernel_Update_Priority(p);
+	}
+
+	Kernel_Update_Priority(owner);
+
+	return p;
+}
+
+/**
+  *  Terminate a task
+  */
+static void Kernel_Terminate_Task() {
+	Cp->state = TERMINATED;
+
+	/** Every mutex still held goes to its next owner */
+	while (Cp->held != NULL) {
+		Kernel_Release_Mutex(Cp->held);
+	}
+
+	Kernel_Free_Stack(Cp->workSpace, Cp->stackSize);
+	Cp->workSpace = NULL;
+
+	/** The schedule stops with its executive, the tick must not ready the reused PD */
+	if (Cp == Executive) {
+		Executive = NULL;
+	}
+
+	Cp->state = DEAD;
+	Cp->inheritedPy = MINPRIORITY;
+	Cp->py = MINPRIORITY;
+	Cp->p = 0;
+	Tasks--;
+}
+
+/**
+  *  Initialize a mutex
+  */
+MUTEX Kernel_Init_Mutex_At(volatile MTX *m, PRIORITY ceiling) {
+	m->m = Mutexes;
+	m->state = FREE;
+	m->ceiling = ceiling;
+	m->waiters.head = NULL;
+	m->holder = NULL;
+	m->nextHeld = NULL;
+	Mutexes++;
+
+	return m->m;
+}
+
+/**
+  *  Find a free mutex to initialize
+  */
+static MUTEX Kernel_Init_Mutex(PRIORITY ceiling) {
+	int x;
+
+	if (Mutexes == MAXMUTEX) return; // Too many mutexes!
+
+	if ((ceiling != NOCEILING) && (ceiling > MINPRIORITY)) {
+		ceiling = MINPRIORITY;
+	}
+
+	// find a Disabled mutex that we can use
+	for (x = 0; x < MAXMUTEX; x++) {
+		if (Mutex[x].state == DISABLED) break;
+	}
+
+	unsigned int m = Kernel_Init_Mutex_At( &(Mutex[x]), ceiling );
+
+	return m;
+}
+
+/**
+  *  Lock a mutex, returns 0 if Cp blocked. Cp->response is 1 once Cp owns it.
+  */
+static unsigned int Kernel_Lock_Mutex() {
+	int i;
+	MUTEX m = Cp->m;
+
+	Cp->response = 1;
+
+	for(i = 0; i < MAXMUTEX; i++) {
+		if (Mutex[i].m == m) break;
+	}
+
+	if(i>=MAXMUTEX){
+		Cp->response = 0;
+		return 1;
+	}
+
+	if(Mutex[i].state == FREE) {
+		Mutex[i].state = LOCKED;
+		Mutex[i].lockCount = 1;
+		Kernel_Take_Mutex(&Mutex[i], Cp);
+
+		/** Immediate ceiling: run at the ceiling for as long as it is held */
+		if (Mutex[i].ceiling < Cp->inheritedPy) {
+			Kernel_Set_Priority(Cp, Mutex[i].ceiling);
+		}
+	}
+	else if (Mutex[i].owner == Cp->p) {
+		Mutex[i].lockCount++;
+	}
+	else if (Cp->reqTimeout == 0) {
+		Cp->response = 0;
+	}
+	else {
+		/** Only reached for a ceiling mutex if its owner blocked while holding it */
+		Cp->blockedOn = &Mutex[i];
+		Kernel_Block(&Mutex[i].waiters, BLOCKED_ON_MUTEX);
+
+		/** The owner, and whoever it waits on in turn, inherits Cp's priority */
+		Kernel_Update_Priority(Mutex[i].holder);
+
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+  *  Unlock a mutex, returns 1 if Cp has to hand the CPU to the new owner
+  */
+static unsigned int Kernel_Unlock_Mutex() {
+	int i;
+	MUTEX m = Cp->m;
+	volatile PD *p;
+
+	for(i = 0; i < MAXMUTEX; i++) {
+		if (Mutex[i].m == m) break;
+	}
+
+	if(i >= MAXMUTEX){
+		return 0;
+	}
+
+	if(Mutex[i].owner != Cp->p){
+		return 0;
+	} 
+
+	if (Mutex[i].lockCount > 1) {
+		Mutex[i].lockCount--;
+		return 0;
+	}
+
+	/** Ownership passes straight to the most urgent waiter */
+	p = Kernel_Release_Mutex(&Mutex[i]);
+
+	/** Dropping a ceiling or inherited priority may uncover a more urgent task */
+	if (Kernel_Ready_Before(0)) {
+		Cp->state = READY;
+		enqueueRQ(&Cp, &ReadyQueue);
+		return 1;
+	}
+
+	if(p == NULL){
+		// Turn on pin for newly running task
+		// For testing
+		if (Cp->p <= 1) {
+			enable_LED(PORTL2);
+		}
+		else if (Cp->p == 2) {
+			enable_LED(PORTL5);
+		}
+		else if (Cp->p == 3) {
+			enable_LED(PORTL6);
+		}
+	}
+	else if ((p->state == READY) && (p->suspended == 0) && Kernel_Not_After(p)) {
+		Cp->state = READY;
+		enqueueRQ(&Cp, &ReadyQueue);
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+  *  Initialize an event
+  */
+EVENT Kernel_Init_Event_At(volatile EVT *e) {
+	e->e = Events;
+	e->state = UNSIGNALLED;
+	e->waiters.head = NULL;
+
+	Events++;
+
+	return e->e;
+}
+
+/**
+  *  Find an event to initialize
+  */
+static EVENT Kernel_Init_Event() {
+	int x;
+
+	if (Events == MAXEVENT) return; // Too many mutexes!
+
+	// find a Disabled mutex that we can use
+	for (x = 0; x < MAXEVENT; x++) {
+		if (Event[x].state == INACTIVE) break;
+	}
+
+	unsigned int e = Kernel_Init_Event_At( &(Event[x]) );
+
+	return e;
+}
+
+/**
+  *  Find an event, NULL if there is none
+  */
+static volatile EVT *Kernel_Find_Event(EVENT e) {
+	int i;
+
+	for (i = 0; i < MAXEVENT; i++) {
+		if ((Event[i].e == e) && (Event[i].state != INACTIVE)) {
+			return &Event[i];
+		}
+	}
+
+	return NULL;
+}
+
+/**
+  *  Wait on an event, returns 1 if Cp blocked. A signal that found nobody
+  *  waiting is consumed instead.
+  */
+static unsigned int Kernel_Wait_Event() {
+	volatile EVT *e = Kernel_Find_Event(Cp->eSend);
+
+	Cp->response = 0;
+
+	if (e == NULL) {
+		return 0;
+	}
+
+	if (e->state == SIGNALLED) {
+		e->state = UNSIGNALLED;
+		Cp->response = 1;
+		return 0;
+	}
+
+	if (Cp->reqTimeout == 0) {
+		return 0;
+	}
+
+	Kernel_Block(&e->waiters, WAITING);
+	return 1;
+}
+
+/**
+  *  Signal an event on behalf of a task or an ISR. Readies the most urgent
+  *  waiter and returns it, or latches the event and returns NULL if nobody
+  *  waits. With all set, every waiter is readied and the most urgent one
+  *  is returned.
+  */
+static volatile PD *Kernel_Wake_Event(EVENT e, unsigned int all) {
+	volatile EVT *evt = Kernel_Find_Event(e);
+	volatile PD *first;
+
+	if (evt == NULL) {
+		return NULL;
+	}
+
+	first = Kernel_Unblock(&evt->waiters, 1);
+
+	if (first == NULL) {
+		evt->state = SIGNALLED;
+		return NULL;
+	}
+
+	while (all && (Kernel_Unblock(&evt->waiters, 1) != NULL));
+
+	return first;
+}
+
+/**
+  *  Signal an event, returns 1 if Cp has to hand the CPU to a woken task
+  */
+static unsigned int Kernel_Signal_Event(unsigned int all) {
+	volatile PD *p = Kernel_Wake_Event(Cp->eSend, all);
+
+	if (p != NULL) {
+		return Kernel_Yield_To(p);
+	}
+
+	return 0;
+}
+
+/**
+  *  Create a counting semaphore, returns 0 if there is none left
+  */
+static SEMAPHORE Kernel_Init_Sem(unsigned int count) {
+	int x;
+
+	if (Semaphores == MAXSEM) {
+		return 0;
+	}
+
+	for (x = 0; x < MAXSEM; x++) {
+		if (Sem[x].s == 0) break;
+	}
+
+	Semaphores++;
+
+	Sem[x].s = Semaphores;
+	Sem[x].count = count;
+	Sem[x].waiters.head = NULL;
+
+	return Sem[x].s;
+}
+
+/**
+  *  Find a semaphore, NULL if there is none
+  */
+static volatile SEM *Kernel_Find_Sem(SEMAPHORE s) {
+	int i;
+
+	for (i = 0; i < MAXSEM; i++) {
+		if ((Sem[i].s == s) && (s != 0)) {
+			return &Sem[i];
+		}
+	}
+
+	return NULL;
+}
+
+/**
+  *  Take a semaphore unit, returns 1 if Cp blocked
+  */
+static unsigned int Kernel_Wait_Sem() {
+	volatile SEM *s = Kernel_Find_Sem(Cp->s);
+
+	Cp->response = 0;
+
+	if (s == NULL) {
+		return 0;
+	}
+
+	if (s->count > 0) {
+		s->count--;
+		Cp->response = 1;
+		return 0;
+	}
+
+	if (Cp->reqTimeout == 0) {
+		return 0;
+	}
+
+	Kernel_Block(&s->waiters, BLOCKED_ON_SEM);
+	return 1;
+}
+
+/**
+  *  Give a semaphore unit back, straight to the most urgent waiter if there
+  *  is one. Returns that waiter, NULL if the count went up instead.
+  */
+static volatile PD *Kernel_Wake_Sem(SEMAPHORE sem) {
+	volatile SEM *s = Kernel_Find_Sem(sem);
+	volatile PD *p;
+
+	if (s == NULL) {
+		return NULL;
+	}
+
+	p = Kernel_Unblock(&s->waiters, 1);
+
+	if (p == NULL) {
+		s->count++;
+	}
+
+	return p;
+}
+
+/**
+  *  Post a semaphore, returns 1 if Cp has to hand the CPU to a woken task
+  */
+static unsigned int Kernel_Post_Sem() {
+	volatile PD *p = Kernel_Wake_Sem(Cp->s);
+
+	if (p != NULL) {
+		return Kernel_Yield_To(p);
+	}
+
+	return 0;
+}
+
+/**
+  *  Create an event group with every flag clear, returns 0 if there is
+  *  none left
+  */
+static EVENTGROUP Kernel_Init_Group() {
+	int x;
+
+	if (Groups == MAXGROUP) {
+		return 0;
+	}
+
+	for (x = 0; x < MAXGROUP; x++) {
+		if (Group[x].g == 0) break;
+	}
+
+	Groups++;
+
+	Group[x].g = Groups;
+	Group[x].bits = 0;
+	Group[x].waiters.head = NULL;
+
+	return Group[x].g;
+}
+
+/**
+  *  Find an event group, NULL if there is none
+  */
+static volatile EVG *Kernel_Find_Group(EVENTGROUP g) {
+	int i;
+
+	for (i = 0; i < MAXGROUP; i++) {
+		if ((Group[i].g == g) && (g != 0)) {
+			return &Group[i];
+		}
+	}
+
+	return NULL;
+}
+
+/**
+  *  1 if the flags in bits satisfy a wait for want in the given mode
+  */
+static unsigned int Kernel_Group_Satisfied(unsigned int bits, unsigned int want, unsigned int mode) {
+	if (mode & EG_ALL) {
+		return (bits & want) == want;
+	}
+
+	return (bits & want) != 0;
+}
+
+/**
+  *  Wait on an event group, returns 1 if Cp blocked. Cp->response is the
+  *  value of the flags that satisfied the wait.
+  */
+static unsigned int Kernel_Wait_Group() {
+	volatile EVG *g = Kernel_Find_Group(Cp->g);
+
+	Cp->response = 0;
+
+	if (g == NULL) {
+		return 0;
+	}
+
+	if (Kernel_Group_Satisfied(g->bits, Cp->reqBits, Cp->reqMode)) {
+		Cp->response = g->bits;
+
+		if (Cp->reqMode & EG_CLEAR) {
+			g->bits &= ~Cp->reqBits;
+		}
+
+		return 0;
+	}
+
+	if (Cp->reqTimeout == 0) {
+		return 0;
+	}
+
+	Kernel_Block(&g->waiters, WAITING);
+	return 1;
+}
+
+/**
+  *  Set flags in an event group and ready every waiter they satisfy. All
+  *  waiters see the same flags; the ones asked to be cleared on exit are
+  *  cleared once every waiter was checked. Returns 1 if Cp has to hand
+  *  the CPU to a woken task.
+  */
+static unsigned int Kernel_Set_Group() {
+	volatile EVG *g = Kernel_Find_Group(Cp->g);
+	volatile PD *p;
+	volatile PD *next;
+	unsigned int clear = 0;
+	unsigned int yield = 0;
+
+	if (g == NULL) {
+		return 0;
+	}
+
+	g->bits |= Cp->reqBits;
+
+	for (p = g->waiters.head; p != NULL; p = next) {
+		next = p->next;
+
+		if (Kernel_Group_Satisfied(g->bits, p->reqBits, p->reqMode)) {
+			if (p->reqMode & EG_CLEAR) {
+				clear |= p->reqBits;
+			}
+
+			Kernel_Unblock_Task(p, g->bits);
+
+			if ((p->suspended == 0) && Kernel_Before(p)) {
+				yield = 1;
+			}
+		}
+	}
+
+	g->bits &= ~clear;
+
+	if (yield) {
+		Cp->state = READY;
+		enqueueRQ(&Cp, &ReadyQueue);
+	}
+
+	return yield;
+}
+
+/**
+  *  Clear flags in an event group, Cp->response is the flags before
+  */
+static void Kernel_Clear_Group() {
+	volatile EVG *g = Kernel_Find_Group(Cp->g);
+
+	Cp->response = 0;
+
+	if (g != NULL) {
+		Cp->response = g->bits;
+		g->bits &= ~Cp->reqBits;
+	}
+}
+
+/**
+  *  Create a message queue in a buffer of capacity messages of size bytes,
+  *  returns 0 if there is no queue left
+  */
+static QUEUE Kernel_Init_Queue(void *buf, unsigned int size, unsigned int capacity) {
+	int x;
+
+	if ((Queues == MAXQUEUE) || (buf == NULL) || (size == 0) || (capacity == 0)) {
+		return 0;
+	}
+
+	for (x = 0; x < MAXQUEUE; x++) {
+		if (Queue[x].q == 0) break;
+	}
+
+	Queues++;
+
+	Queue[x].q = Queues;
+	Queue[x].buf = buf;
+	Queue[x].msgSize = size;
+	Queue[x].capacity = capacity;
+	Queue[x].head = 0;
+	Queue[x].count = 0;
+	Queue[x].senders.head = NULL;
+	Queue[x].receivers.head = NULL;
+
+	return Queue[x].q;
+}
+
+/**
+  *  Find a message queue, NULL if there is none
+  */
+static volatile MQ *Kernel_Find_Queue(QUEUE q) {
+	int i;
+
+	for (i = 0; i < MAXQUEUE; i++) {
+		if ((Queue[i].q == q) && (q != 0)) {
+			return &Queue[i];
+		}
+	}
+
+	return NULL;
+}
+
+/**
+  *  Copy a message into the tail of a queue that has room for it
+  */
+static void Kernel_Put_Message(volatile MQ *q, const void *msg) {
+	unsigned int tail = q->head + q->count;
+
+	if (tail >= q->capacity) {
+		tail -= q->capacity;
+	}
+
+	memcpy(q->buf + (tail * q->msgSize), msg, q->msgSize);
+	q->count++;
+}
+
+/**
+  *  Send Cp's message, returns 1 if Cp blocked or has to hand the CPU to
+  *  the receiver. Cp->response is 1 once the message is delivered.
+  */
+static unsigned int Kernel_Send_Queue() {
+	volatile MQ *q = Kernel_Find_Queue(Cp->q);
+	volatile PD *p;
+
+	Cp->response = 0;
+
+	if (q == NULL) {
+		return 0;
+	}
+
+	/** The queue is empty if anybody waits on it, hand the message over */
+	if ((p = q->receivers.head) != NULL) {
+		memcpy(p->reqMsg, Cp->reqMsg, q->msgSize);
+		Kernel_Unblock(&q->receivers, 1);
+		Cp->response = 1;
+		return Kernel_Yield_To(p);
+	}
+
+	if (q->count < q->capacity) {
+		Kernel_Put_Message(q, Cp->reqMsg);
+		Cp->response = 1;
+		return 0;
+	}
+
+	if (Cp->reqTimeout == 0) {
+		return 0;
+	}
+
+	Kernel_Block(&q->senders, BLOCKED_ON_QUEUE);
+	return 1;
+}
+
+/**
+  *  Receive into Cp's buffer, returns 1 if Cp blocked or has to hand the
+  *  CPU to a sender. Cp->response is 1 once a message is received.
+  */
+static unsigned int Kernel_Recv_Queue() {
+	volatile MQ *q = Kernel_Find_Queue(Cp->q);
+	volatile PD *p;
+
+	Cp->response = 0;
+
+	if (q == NULL) {
+		return 0;
+	}
+
+	if (q->count == 0) {
+		if (Cp->reqTimeout == 0) {
+			return 0;
+		}
+
+		Kernel_Block(&q->receivers, BLOCKED_ON_QUEUE);
+		return 1;
+	}
+
+	memcpy(Cp->reqMsg, q->buf + (q->head * q->msgSize), q->msgSize);
+	Cp->response = 1;
+
+	q->head++;
+	if (q->head == q->capacity) {
+		q->head = 0;
+	}
+	q->count--;
+
+	/** A slot just opened up, take the message of the first blocked sender */
+	if ((p = q->senders.head) != NULL) {
+		Kernel_Put_Message(q, p->reqMsg);
+		Kernel_Unblock(&q->senders, 1);
+		return Kernel_Yield_To(p);
+	}
+
+	return 0;
+}
+
+/**
+  * Releases the next slot of the cyclic schedule. An idle executive is
+  * handed the slot at once; a busy one has overrun the slot it is on, and
+  * the release is kept pending so no slot is ever skipped.
+  */
+static void Kernel_Cyclic_Release() {
+	unsigned int next;
+
+	if ((Executive->state == CYCLIC_IDLE) && (CyclicPending == 0)) {
+		CyclicCurrent = (CyclicCurrent + 1 == CyclicSlots) ? 0 : CyclicCurrent + 1;
+		Executive->response = CyclicCurrent;
+		Kernel_Make_Ready(Executive);
+	}
+	else {
+		CyclicOverruns[CyclicCurrent]++;
+		CyclicPending++;
+	}
+
+	/** Ticks until the slot after this one, across the end of the hyperperiod */
+	next = (CyclicNext + 1 == CyclicSlots) ? 0 : CyclicNext + 1;
+
+	if (next == 0) {
+		CyclicWait = CyclicPeriod - CyclicTable[CyclicNext].offset + CyclicTable[0].offset;
+	}
+	else {
+		CyclicWait = CyclicTable[next].offset - CyclicTable[CyclicNext].offset;
+	}
+
+	CyclicNext = next;
+}
+
+/**
+  * Counts n ticks off the cyclic schedule, releasing every slot that falls
+  * due. Every gap is at least one tick, so a tick releases at most one slot.
+  */
+static void Kernel_Cyclic_Advance(TIME n) {
+	while (n >= CyclicWait) {
+		n -= CyclicWait;
+		Kernel_Cyclic_Release();
+	}
+
+	CyclicWait -= n;
+}
+
+/**
+  * Body of the cyclic executive: run the slot it was released for, then
+  * wait for the next one. It starts out parked, so it is only ever first
+  * dispatched by a release, with the slot already in Cp->response.
+  */
+static void Kernel_Executive() {
+	for(;;) {
+		CyclicTable[Cp->response].f();
+
+		Disable_Interrupt();
+		Cp->request = CYCLIC_WAIT;
+		Enter_Kernel();
+	}
+}
+
+/**
+  * Hands the executive the next pending slot in Cp->response, or parks it
+  * until Kernel_Cyclic_Release() does. Returns 1 if it has to wait.
+  */
+static unsigned int Kernel_Cyclic_Wait() {
+	if (CyclicPending == 0) {
+		Cp->state = CYCLIC_IDLE;
+		return 1;
+	}
+
+	CyclicPending--;
+	CyclicCurrent = (CyclicCurrent + 1 == CyclicSlots) ? 0 : CyclicCurrent + 1;
+	Cp->response = CyclicCurrent;
+
+	return 0;
+}
+
+/**
+  * Starts the cyclic schedule with the hyperperiod beginning now. Offsets
+  * must rise strictly and stay below the hyperperiod. Returns the PID of
+  * the executive, 0 if the table is rejected or a schedule already runs.
+  */
+static PID Kernel_Start_Cyclic(const SLOT *table, unsigned int slots, TICK hyperperiod, PRIORITY py, unsigned int stackSize) {
+	unsigned int i;
+	PID pid;
+
+	if ((Executive != NULL) || (slots == 0) || (slots > MAXSLOT) || (table[slots-1].offset >= hyperperiod)) {
+		return 0;
+	}
+
+	for (i = 1; i < slots; i++) {
+		if (table[i].offset <= table[i-1].offset) {
+			return 0;
+		}
+	}
+
+	pid = Kernel_Create_Task( Kernel_Executive, py, 0, stackSize );
+
+	if (pid == 0) {
+		return 0;
+	}
+
+	for (i = 0; i < MAXSLOT; i++) {
+		CyclicOverruns[i] = 0;
+	}
+
+	CyclicTable = table;
+	CyclicSlots = slots;
+	CyclicPeriod = hyperperiod;
+	CyclicNext = 0;
+	CyclicCurrent = slots - 1;
+	CyclicPending = 0;
+	CyclicWait = table[0].offset;
+
+	/** The executive starts out waiting for the first slot */
+	Executive = Kernel_Find_Task(pid);
+	removeRQ(&Executive, &ReadyQueue);
+	Executive->state = CYCLIC_IDLE;
+
+	Kernel_Cyclic_Advance(0);
+
+	return pid;
+}
+
+/**
+  * Credits n elapsed ticks to the system time and readies every sleeper
+  * that is now due.
+  */
+static void Kernel_Advance_Time(TIME n) {
+	volatile PD *p;
+	volatile PD *owner;
+
+	SystemTick += n;
+
+	if (Executive != NULL) {
+		Kernel_Cyclic_Advance(n);
+	}
+
+	/** Only the head of the delta list is touched, plus any task that is due */
+	tickSQ(&SleepQueue, n);
+
+	while ((p = dequeueSQ(&SleepQueue)) != NULL) {
+		if (p->timed) {
+			/** A bounded wait ran out, the request it was made for failed */
+			removeWL(&p, p->waitList);
+			p->timed = 0;
+			p->response = 0;
+
+			/** The owner no longer inherits anything from p */
+			if (p->blockedOn != NULL) {
+				owner = p->blockedOn->holder;
+				p->blockedOn = NULL;
+				Kernel_Update_Priority(owner);
+			}
+		}
+
+		Kernel_Make_Ready(p);
+	}
+}
+
+#ifdef TICKLESS
+/**
+  * Called when only the idle task can run. Stretches the current Timer1
+  * period so that the next compare match lands on the tick the earliest
+  * sleeper is due, instead of interrupting every MSECPERTICK ms.
+  */
+static void Kernel_Enter_Tickless() {
+	TIME span = MAXTICKLESS - TicklessBase;
+
+	if (TicklessSpan > 1) {
+		return;
+	}
+
+	if ((SleepQueue.head != NULL) && (SleepQueue.head->delta < span)) {
+		span = SleepQueue.head->delta;
+	}
+
+	/** Wake up in time for the next cyclic slot as well */
+	if ((Executive != NULL) && (CyclicWait < span)) {
+		span = CyclicWait;
+	}
+
+	if (span > 1) {
+		TicklessSpan = span;
+		OCR1A = ((TicklessBase + span) * TICKCOUNT) - 1;
+	}
+}
+
+/**
+  * Called when a task is dispatched in the middle of a stretched period,
+  * e.g. after another interrupt woke it. The whole ticks that already
+  * passed are credited now and the period is cut at the next tick boundary.
+  */
+static void Kernel_Exit_Tickless() {
+	unsigned int tick = TICKCOUNT;
+	unsigned int counts = TCNT1;
+	unsigned int elapsed;
+
+	/** The stretched period ended, or ends too soon to be cut, the ISR will credit it */
+	if ((TIFR1 & (1 << OCF1A)) || (counts >= OCR1A - EXITMARGIN)) {
+		return;
+	}
+
+	/** Whole ticks since the Timer1 period started, in 16 bits to keep this short */
+	elapsed = counts / tick;
+
+	/** Too close to the boundary to still catch it with OCR1A, count it now */
+	if (counts - (elapsed * tick) >= tick - EXITMARGIN) {
+		elapsed++;
+	}
+
+	OCR1A = ((elapsed + 1) * tick) - 1;
+
+	/** Timer1 passed the new compare value before it was written, credit that tick too */
+	while (TCNT1 > OCR1A) {
+		elapsed++;
+		OCR1A = ((elapsed + 1) * tick) - 1;
+	}
+
+	TicklessSpan = 1;
+
+	Kernel_Advance_Time(elapsed - TicklessBase);
+	TicklessBase = elapsed;
+}
+#endif
+
+/**
+  * Keeps cost at the longest time measured so far, from start to now in
+  * Timer1 counts plus the frame save and restore around it. A sample that
+  * spans a compare match, or lasts longer than a tick, is dropped.
+  */
+static void Kernel_Measure(volatile unsigned int *cost, unsigned int start) {
+	unsigned int end = TCNT1;
+
+	if ((end < start) || (end - start >= TICKCOUNT - FRAMECOST)) {
+		return;
+	}
+
+	end = end - start + FRAMECOST;
+
+	if (end > *cost) {
+		*cost = end;
+	}
+}
+
+/**
+  * This internal kernel function is the "scheduler". It chooses the 
+  * next task to run, i.e., Cp.
   */
 static void Dispatch() {
-	Cp = dequeueRQ(&ReadyQueue, &RQCount);
+	Cp = dequeueRQ(&ReadyQueue);
 
 	if (Cp == NULL) {
-		OS_Abort();
+		Kernel_Abort(ABORT_NO_TASK, 0);
+	}
+
+	CurrentSp = Cp->sp;
+	Cp->state = RUNNING;
+
+	if ((Cp->period > 0) && !Cp->started) {
+		Cp->started = 1;
+		Cp->start = SystemTick;
+	}
+
+#ifdef TICKLESS
+	if (Cp == IdleTask) {
+		Kernel_Enter_Tickless();
+	}
+	else if (TicklessSpan > 1) {
+		Kernel_Exit_Tickless();
+	}
+#endif
+
+	// For testing
+	if (Cp->p <= 1) {
+		enable_LED(PORTL2);
+	}
+	else if (Cp->p == 2) {
+		enable_LED(PORTL5);
+	}
+	else if (Cp->p == 3) {
+		enable_LED(PORTL6);
 	}
+}
+
+/**
+  * Carries out Cp's pending request. Returns 1 if Cp has to give up the CPU,
+  * in which case Cp has already been queued wherever it belongs and the
+  * caller must Dispatch() a new task. Runs either in the kernel or, for
+  * direct system calls, on the caller's stack; interrupts are disabled
+  * in both cases.
+  */
+static unsigned int Kernel_Request() {
+	switch(Cp->request){
+	case CREATE:
+		Cp->response = Kernel_Create_Task( Cp->reqCode, Cp->reqPy, Cp->reqArg, Cp->reqStack );
+		return 0;
+	case CREATE_WORKER:
+		Cp->response = Kernel_Create_Worker( Cp->reqPy, Cp->reqStack );
+		return 0;
+	case CREATE_PERIODIC:
+		Cp->response = Kernel_Create_Periodic( Cp->reqCode, Cp->reqPy, Cp->reqArg, Cp->reqPeriod, Cp->reqWcet, Cp->reqOffset, Cp->reqStack );
+		return 0;
+	case PARK:
+		Cp->state = PARKED;
+		return 1;
+	case REARM:
+		return Kernel_Rearm_Worker();
+	case NEXT:
+	case NONE:  /* preempted from the Timer1 ISR, see Kernel_Tick() */
+		Cp->state = READY;
+		enqueueRQ(&Cp, &ReadyQueue);
+		return 1;
+	case CYCLIC_START:
+		Cp->response = Kernel_Start_Cyclic( Cp->reqTable, Cp->reqCount, Cp->reqPeriod, Cp->reqPy, Cp->reqStack );
+		return 0;
+	case CYCLIC_WAIT:
+		return Kernel_Cyclic_Wait();
+	case NEXT_PERIOD:
+		Kernel_Finish_Job();
+
+		/** A job that overran is released again at once */
+		if (!TIME_AFTER(Cp->wakeTime, SystemTick)) {
+			/** Under EDF a READY job with an earlier deadline goes first */
+			if (Kernel_Ready_Before(0)) {
+				Cp->state = READY;
+				enqueueRQ(&Cp, &ReadyQueue);
+				return 1;
+			}
+
+			/** Otherwise it keeps the CPU without a Dispatch() to stamp its start */
+			Cp->started = 1;
+			Cp->start = SystemTick;
+			return 0;
+		}
+		/* fall through */
+	case SLEEP:
+		if (!TIME_AFTER(Cp->wakeTime, SystemTick)) {
+			return 0;
+		}
+		Cp->delta = Cp->wakeTime - SystemTick;
+		Cp->state = SLEEPING;
+		enqueueSQ(&Cp, &SleepQueue);
+		return 1;
+	case SUSPEND:
+		Kernel_Suspend_Task();
+		if(Cp->suspended) {
+			Cp->state = READY;
+			return 1;
+		}
+		return 0;
+	case RESUME:
+		if(Kernel_Resume_Task()){
+			Cp->state = READY;
+			enqueueRQ(&Cp, &ReadyQueue);
+			return 1;
+		}
+		return 0;
+	case TERMINATE:
+		/* deallocate all resources used by this task */
+		Kernel_Terminate_Task();
+		return 1;
+	case MUTEX_INIT:
+		Cp->response = Kernel_Init_Mutex( Cp->reqPy );
+		return 0;
+	case MUTEX_LOCK:
+		return !Kernel_Lock_Mutex();
+	case MUTEX_UNLOCK:
+		return Kernel_Unlock_Mutex();
+	case EVENT_INIT:
+		Cp->response = Kernel_Init_Event();
+		return 0;
+	case EVENT_WAIT:
+		if (Kernel_Wait_Event()) {
+			return 1;
+		}
 
-	CurrentSp = Cp->sp;
-	Cp->state = RUNNING;
+		// For testing
+		if (Cp->p <= 1) {
+			enable_LED(PORTL2);
+		}
+		else if (Cp->p == 2) {
+			enable_LED(PORTL5);
+		}
+		else if (Cp->p == 3) {
+			enable_LED(PORTL6);
+		}
 
-	// For testing
-	if (Cp->p <= 1) {
-		enable_LED(PORTL2);
-	}
-	else if (Cp->p == 2) {
-		enable_LED(PORTL5);
-	}
-	else if (Cp->p == 3) {
-		enable_LED(PORTL6);
+		return 0;
+	case EVENT_SIGNAL:
+		return Kernel_Signal_Event(0);
+	case EVENT_BROADCAST:
+		return Kernel_Signal_Event(1);
+	case SEM_INIT:
+		Cp->response = Kernel_Init_Sem( Cp->reqCount );
+		return 0;
+	case SEM_WAIT:
+		return Kernel_Wait_Sem();
+	case SEM_POST:
+		return Kernel_Post_Sem();
+	case GROUP_INIT:
+		Cp->response = Kernel_Init_Group();
+		return 0;
+	case GROUP_WAIT:
+		return Kernel_Wait_Group();
+	case GROUP_SET:
+		return Kernel_Set_Group();
+	case GROUP_CLEAR:
+		Kernel_Clear_Group();
+		return 0;
+	case QUEUE_INIT:
+		Cp->response = Kernel_Init_Queue( Cp->reqMsg, Cp->reqSize, Cp->reqCount );
+		return 0;
+	case QUEUE_SEND:
+		return Kernel_Send_Queue();
+	case QUEUE_RECV:
+		return Kernel_Recv_Queue();
+	case SWITCH:
+		/* already carried out on the caller's stack, see Kernel_Syscall() */
+		return 1;
+	default:
+		/* Houston! we have a problem! */
+		return 0;
 	}
 }
 
@@ -549,11 +2170,9 @@ static void Dispatch() {
   * This is the main loop of our kernel, called by OS_Start().
   */
 static void Next_Kernel_Request() {
-	Dispatch();  /* select a new task to run */
+	unsigned int start;
 
-	unsigned int mutex_is_locked;
-	unsigned int resumed;
-	unsigned int waiting;
+	Dispatch();  /* select a new task to run */
 
 	while(1) {
 		Cp->request = NONE; /* clear its request */
@@ -563,6 +2182,8 @@ static void Next_Kernel_Request() {
 
 		Exit_Kernel();    /* or CSwitch() */
 
+		start = TCNT1;
+
 		// For testing
 		disable_LED(PORTL2);
 		disable_LED(PORTL5);
@@ -573,236 +2194,646 @@ static void Next_Kernel_Request() {
 		/* save the Cp's stack pointer */
 		Cp->sp = CurrentSp;
 
-		switch(Cp->request){
-		case CREATE:
-			Cp->response = Kernel_Create_Task( Cp->code, Cp->py, Cp->arg );
-			break;
-		case NEXT:
-		case NONE:
-			Cp->state = READY;
-			enqueueRQ(&Cp, &ReadyQueue, &RQCount);
-			Dispatch();
-			break;
-		case SLEEP:
-			Cp->state = SLEEPING;
-			enqueueSQ(&Cp, &SleepQueue, &SQCount);
-			Dispatch();
-			break;
-		case SUSPEND:
-			Kernel_Suspend_Task();
-			if(Cp->suspended) {
-				Cp->state = READY;
-				enqueueRQ(&Cp, &ReadyQueue, &RQCount);
-				Dispatch();
-			}
-			break;
-		case RESUME:
-			resumed = Kernel_Resume_Task();
-			if(resumed){
-				Cp->state = READY;
-				enqueueRQ(&Cp, &ReadyQueue, &RQCount);
-				Dispatch();
-			}
-			break;
-		case TERMINATE:
-			/* deallocate all resources used by this task */
-			Kernel_Terminate_Task();
+		Kernel_Check_Stack(Cp);
+
+		if (Kernel_Request()) {
 			Dispatch();
-			break;
-		case MUTEX_INIT:
-			Cp->response = Kernel_Init_Mutex();
-			break;
-		case MUTEX_LOCK:
-			mutex_is_locked = Kernel_Lock_Mutex();
-			if (!mutex_is_locked) {
-				Dispatch();
-			}
-			break;
-		case MUTEX_UNLOCK:
-			Kernel_Unlock_Mutex();
-            break;
-        case EVENT_INIT:
-        	Cp->response = Kernel_Init_Event();
-        	break;
-        case EVENT_WAIT:
-        	waiting = Kernel_Wait_Event();
-        	if (waiting) {
-				Cp->state = WAITING;
-        		enqueueRQ(&Cp, &ReadyQueue, &RQCount);
-        		Dispatch();
-        	}
-        	
-        	// For testing
-			if (Cp->p <= 1) {
-				enable_LED(PORTL2);
-			}
-			else if (Cp->p == 2) {
-				enable_LED(PORTL5);
-			}
-			else if (Cp->p == 3) {
-				enable_LED(PORTL6);
-			}
+		}
+
+		Kernel_Measure(&SwitchCost, start);
+	} 
+}
+
+/*================
+  * RTOS  API  and Stubs
+  *================
+  */
+
+/**
+  * Hands Cp->request to the kernel. With DIRECT_SYSCALLS the request is
+  * first carried out right here on the caller's stack, with interrupts
+  * still disabled, and the kernel stack is only switched to if Cp has to
+  * give up the CPU. Must be called with interrupts disabled.
+  */
+static void Kernel_Syscall() {
+#ifdef DIRECT_SYSCALLS
+	if (!Kernel_Request()) {
+		Cp->request = NONE;
+		Enable_Interrupt();
+		return;
+	}
+
+	Cp->request = SWITCH;
+#endif
+	Enter_Kernel();
+}
+
+/**
+  * This function initializes the RTOS and must be called first
+  */
+void OS_Init() {
+	int x;
+
+	Tasks = 0;
+	KernelActive = 0;
+	Mutexes = 0;
+	Events = 0;
+	Queues = 0;
+	Semaphores = 0;
+	Groups = 0;
+	pCount = 0;
+	SystemTick = 0;
+
+	for (x = 0; x < MAXTHREAD; x++) {
+		memset(&(Process[x]),0,sizeof(PD));
+		Process[x].state = DEAD;
+		Process[x].p = 0;
+	}
+
+	for (x = 0; x < MAXMUTEX; x++) {
+		memset(&(Mutex[x]),0,sizeof(MTX));
+		Mutex[x].state = DISABLED;
+	}
+
+	for (x = 0; x < MAXEVENT; x++) {
+		memset(&(Event[x]),0,sizeof(EVT));
+		Event[x].state = INACTIVE;
+	}
+
+	for (x = 0; x < MAXSEM; x++) {
+		memset(&(Sem[x]),0,sizeof(SEM));
+	}
+
+	for (x = 0; x < MAXGROUP; x++) {
+		memset(&(Group[x]),0,sizeof(EVG));
+	}
+
+	for (x = 0; x < MAXQUEUE; x++) {
+		memset(&(Queue[x]),0,sizeof(MQ));
+	}
+
+	FreeStacks = (STACKBLK *)StackArena;
+	FreeStacks->size = STACKARENA;
+	FreeStacks->next = NULL;
+
+	/** The idle task takes the first PD and PID 0 */
+	IdleTask = &Process[0];
+	Kernel_Create_Task_At(IdleTask, Kernel_Idle, IDLEPRIORITY, 0, MINSTACK);
+}
+
+/**
+  * This function starts the RTOS after creating a_main
+  */
+void OS_Start() {   
+	if ( (! KernelActive) && (Tasks > 1)) {  /* more than just the idle task */
+		Disable_Interrupt();
+
+		KernelActive = 1;
+		Next_Kernel_Request();
+		/* SHOULD NEVER GET HERE!!! */
+	}
+}
+
+/**
+  * Just quits
+  */
+void OS_Abort() {
+	exit(1);
+}
+
+/**
+  * Application level mutex init to setup system call
+  */
+MUTEX Mutex_Init() {
+	if(KernelActive) {
+		Disable_Interrupt();
+		Cp->request = MUTEX_INIT;
+		Cp->reqPy = NOCEILING;
+		Kernel_Syscall();
+		return Cp->response;
+	}
+}
+
+/**
+  * Application level ceiling mutex init to setup system call. The locker
+  * runs at ceiling while it holds the mutex, which must be at least as
+  * urgent as every task that locks it.
+  */
+MUTEX Mutex_InitCeiling(PRIORITY ceiling) {
+	if(KernelActive) {
+		Disable_Interrupt();
+		Cp->request = MUTEX_INIT;
+		Cp->reqPy = ceiling;
+		Kernel_Syscall();
+		return Cp->response;
+	}
+}
+
+/**
+  * Application level mutex lock to setup system call, gives up after t
+  * ticks. Returns 1 if Cp now owns m.
+  */
+int Mutex_LockTimeout(MUTEX m, TICK t) {
+	if(KernelActive) {
+		Disable_Interrupt();
+		Cp->request = MUTEX_LOCK;
+		Cp->m = m;
+		Cp->reqTimeout = t;
+		Kernel_Syscall();
+		return Cp->response;
+	}
+
+	return 0;
+}
+
+/**
+  * Application level mutex lock, blocks until m is free
+  */
+void Mutex_Lock(MUTEX m) {
+	Mutex_LockTimeout(m, WAIT_FOREVER);
+}
+
+/**
+  * Application level mutex unlock to setup system call
+  */
+void Mutex_Unlock(MUTEX m) {
+	if(KernelActive) {
+		Disable_Interrupt();
+		Cp->request = MUTEX_UNLOCK;
+		Cp->m = m;
+		Kernel_Syscall();
+	}
+}
+
+/**
+  * Application level event init to setup system call
+  */
+EVENT Event_Init() {
+	if(KernelActive) {
+		Disable_Interrupt();
+		Cp->request = EVENT_INIT;
+		Kernel_Syscall();
+		return Cp->response;
+	}
+}
+
+/**
+  * Application level event wait to setup system call, gives up after t
+  * ticks. Returns 1 if e was signalled.
+  */
+int Event_WaitTimeout(EVENT e, TICK t) {
+	if(KernelActive) {
+		Disable_Interrupt();
+		Cp->request = EVENT_WAIT;
+		Cp->eSend = e;
+		Cp->reqTimeout = t;
+		Kernel_Syscall();
+		return Cp->response;
+	}
+
+	return 0;
+}
+
+/**
+  * Application level event wait, blocks until e is signalled
+  */
+void Event_Wait(EVENT e) {
+	Event_WaitTimeout(e, WAIT_FOREVER);
+}
+
+/**
+  * Application level event signal to setup system call
+  */
+void Event_Signal(EVENT e) {
+	if(KernelActive) {
+		Disable_Interrupt();
+		Cp->request = EVENT_SIGNAL;
+		Cp->eSend = e;
+		Kernel_Syscall();
+	}
+}
+
+/**
+  * Interrupt level event signal. Readies the waiting task without switching
+  * to it; it runs at the next tick, or at once if the CPU was idle.
+  * Only call this from an ISR, with interrupts disabled.
+  */
+void Event_SignalFromISR(EVENT e) {
+	if(KernelActive) {
+		Kernel_Wake_Event(e, 0);
+	}
+}
+
+/**
+  * Interrupt level event broadcast, readies every waiting task without
+  * switching to any of them. Only call this from an ISR, with interrupts
+  * disabled.
+  */
+void Event_BroadcastFromISR(EVENT e) {
+	if(KernelActive) {
+		Kernel_Wake_Event(e, 1);
+	}
+}
+
+/**
+  * Application level event broadcast to setup system call, readies every
+  * task waiting on e. Latches e like Event_Signal() if nobody waits.
+  */
+void Event_Broadcast(EVENT e) {
+	if(KernelActive) {
+		Disable_Interrupt();
+		Cp->request = EVENT_BROADCAST;
+		Cp->eSend = e;
+		Kernel_Syscall();
+	}
+}
+
+/**
+  * Application or kernel level semaphore init, count units are available
+  */
+SEMAPHORE Sem_Init(unsigned int count) {
+	SEMAPHORE s;
+
+	if(KernelActive) {
+		Disable_Interrupt();
+		Cp->request = SEM_INIT;
+		Cp->reqCount = count;
+		Kernel_Syscall();
+		s = Cp->response;
+	} else {
+	  /* call the RTOS function directly */
+	  s = Kernel_Init_Sem( count );
+	}
+	return s;
+}
+
+/**
+  * Application level semaphore wait to setup system call, gives up after
+  * t ticks. Returns 1 if a unit was taken.
+  */
+int Sem_WaitTimeout(SEMAPHORE s, TICK t) {
+	if(KernelActive) {
+		Disable_Interrupt();
+		Cp->request = SEM_WAIT;
+		Cp->s = s;
+		Cp->reqTimeout = t;
+		Kernel_Syscall();
+		return Cp->response;
+	}
 
-        	break;
-        case EVENT_SIGNAL:
-        	Kernel_Signal_Event();
-        	break;
-		default:
-			/* Houston! we have a problem! */
-			break;
-		}
-	} 
+	return 0;
 }
 
-/*================
-  * RTOS  API  and Stubs
-  *================
+/**
+  * Application level semaphore wait, blocks until a unit is available
   */
+void Sem_Wait(SEMAPHORE s) {
+	Sem_WaitTimeout(s, WAIT_FOREVER);
+}
 
 /**
-  * This function initializes the RTOS and must be called first
+  * Application level semaphore post to setup system call
   */
-void OS_Init() {
-	int x;
-
-	Tasks = 0;
-	KernelActive = 0;
-	Mutexes = 0;
-	Events = 0;
-	pCount = 0;
-
-	for (x = 0; x < MAXTHREAD; x++) {
-		memset(&(Process[x]),0,sizeof(PD));
-		Process[x].state = DEAD;
-		Process[x].eWait = 99;
-		Process[x].p = 0;
-	}
-
-	for (x = 0; x < MAXMUTEX; x++) {
-		memset(&(Mutex[x]),0,sizeof(MTX));
-		Mutex[x].state = DISABLED;
+void Sem_Post(SEMAPHORE s) {
+	if(KernelActive) {
+		Disable_Interrupt();
+		Cp->request = SEM_POST;
+		Cp->s = s;
+		Kernel_Syscall();
 	}
+}
 
-	for (x = 0; x < MAXEVENT; x++) {
-		memset(&(Event[x]),0,sizeof(EVT));
-		Event[x].state = INACTIVE;
+/**
+  * Interrupt level semaphore post. A woken task runs at the next tick, or
+  * at once if the CPU was idle. Only call this from an ISR.
+  */
+void Sem_PostFromISR(SEMAPHORE s) {
+	if(KernelActive) {
+		Kernel_Wake_Sem(s);
 	}
 }
 
 /**
-  * This function starts the RTOS after creating a_main
+  * Application or kernel level event group init, every flag starts clear
   */
-void OS_Start() {   
-	if ( (! KernelActive) && (Tasks > 0)) {
-		Disable_Interrupt();
+EVENTGROUP EventGroup_Init() {
+	EVENTGROUP g;
 
-		KernelActive = 1;
-		Next_Kernel_Request();
-		/* SHOULD NEVER GET HERE!!! */
+	if(KernelActive) {
+		Disable_Interrupt();
+		Cp->request = GROUP_INIT;
+		Kernel_Syscall();
+		g = Cp->response;
+	} else {
+	  /* call the RTOS function directly */
+	  g = Kernel_Init_Group();
 	}
+	return g;
 }
 
 /**
-  * Just quits
+  * Application level event group set to setup system call, readies every
+  * waiter the new flags satisfy
   */
-void OS_Abort() {
-	exit(1);
+void EventGroup_Set(EVENTGROUP g, unsigned int bits) {
+	if(KernelActive) {
+		Disable_Interrupt();
+		Cp->request = GROUP_SET;
+		Cp->g = g;
+		Cp->reqBits = bits;
+		Kernel_Syscall();
+	}
 }
 
 /**
-  * Application level mutex init to setup system call
+  * Application level event group clear to setup system call, returns the
+  * flags as they were before
   */
-MUTEX Mutex_Init() {
+unsigned int EventGroup_Clear(EVENTGROUP g, unsigned int bits) {
 	if(KernelActive) {
 		Disable_Interrupt();
-		Cp->request = MUTEX_INIT;
-		Enter_Kernel();
+		Cp->request = GROUP_CLEAR;
+		Cp->g = g;
+		Cp->reqBits = bits;
+		Kernel_Syscall();
 		return Cp->response;
 	}
+
+	return 0;
 }
 
 /**
-  * Application level mutex lock to setup system call
+  * Application level event group wait to setup system call. Blocks until
+  * any (EG_ANY) or all (EG_ALL) of bits are set, optionally clearing them
+  * (EG_CLEAR). Returns the flags that satisfied the wait.
   */
-void Mutex_Lock(MUTEX m) {
+unsigned int EventGroup_Wait(EVENTGROUP g, unsigned int bits, unsigned int mode) {
+	return EventGroup_WaitTimeout(g, bits, mode, WAIT_FOREVER);
+}
+
+/**
+  * Application level event group wait that gives up after t ticks,
+  * returning 0 if the wait was not satisfied by then
+  */
+unsigned int EventGroup_WaitTimeout(EVENTGROUP g, unsigned int bits, unsigned int mode, TICK t) {
 	if(KernelActive) {
 		Disable_Interrupt();
-		Cp->request = MUTEX_LOCK;
-		Cp->m = m;
-		Enter_Kernel();
+		Cp->request = GROUP_WAIT;
+		Cp->g = g;
+		Cp->reqBits = bits;
+		Cp->reqMode = mode;
+		Cp->reqTimeout = t;
+		Kernel_Syscall();
+		return Cp->response;
 	}
-	
+
+	return 0;
 }
 
 /**
-  * Application level mutex unlock to setup system call
+  * Application or kernel level message queue init. buf must hold capacity
+  * messages of msgSize bytes and stays owned by the queue.
   */
-void Mutex_Unlock(MUTEX m) {
+QUEUE Queue_Init(void *buf, unsigned int msgSize, unsigned int capacity) {
+	QUEUE q;
+
 	if(KernelActive) {
 		Disable_Interrupt();
-		Cp->request = MUTEX_UNLOCK;
-		Cp->m = m;
-		Enter_Kernel();
+		Cp->request = QUEUE_INIT;
+		Cp->reqMsg = buf;
+		Cp->reqSize = msgSize;
+		Cp->reqCount = capacity;
+		Kernel_Syscall();
+		q = Cp->response;
+	} else {
+	  /* call the RTOS function directly */
+	  q = Kernel_Init_Queue( buf, msgSize, capacity );
 	}
+	return q;
 }
 
 /**
-  * Application level event init to setup system call
+  * Application level message send to setup system call, gives up after
+  * t ticks. Returns 1 if the message was queued or handed to a receiver.
   */
-EVENT Event_Init() {
+int Queue_SendTimeout(QUEUE q, const void *msg, TICK t) {
 	if(KernelActive) {
 		Disable_Interrupt();
-		Cp->request = EVENT_INIT;
-		Enter_Kernel();
+		Cp->request = QUEUE_SEND;
+		Cp->q = q;
+		Cp->reqMsg = (void *)msg;
+		Cp->reqTimeout = t;
+		Kernel_Syscall();
 		return Cp->response;
 	}
+
+	return 0;
 }
 
 /**
-  * Application level event wait to setup system call
+  * Application level message send, blocks while the queue is full
   */
-void Event_Wait(EVENT e) {
-	if(KernelActive) {
-		Disable_Interrupt();
-		Cp->request = EVENT_WAIT;
-		Cp->eSend = e;
-		Enter_Kernel();
-	}
+void Queue_Send(QUEUE q, const void *msg) {
+	Queue_SendTimeout(q, msg, WAIT_FOREVER);
 }
 
 /**
-  * Application level event signal to setup system call
+  * Application level message send that never blocks
   */
-void Event_Signal(EVENT e) {
+int Queue_TrySend(QUEUE q, const void *msg) {
+	return Queue_SendTimeout(q, msg, 0);
+}
+
+/**
+  * Application level message receive to setup system call, gives up after
+  * t ticks. Returns 1 if a message was copied into msg.
+  */
+int Queue_RecvTimeout(QUEUE q, void *msg, TICK t) {
 	if(KernelActive) {
 		Disable_Interrupt();
-		Cp->request = EVENT_SIGNAL;
-		Cp->eSend = e;
-		Enter_Kernel();
+		Cp->request = QUEUE_RECV;
+		Cp->q = q;
+		Cp->reqMsg = msg;
+		Cp->reqTimeout = t;
+		Kernel_Syscall();
+		return Cp->response;
 	}
+
+	return 0;
+}
+
+/**
+  * Application level message receive, blocks while the queue is empty
+  */
+void Queue_Recv(QUEUE q, void *msg) {
+	Queue_RecvTimeout(q, msg, WAIT_FOREVER);
+}
+
+/**
+  * Application level message receive that never blocks
+  */
+int Queue_TryRecv(QUEUE q, void *msg) {
+	return Queue_RecvTimeout(q, msg, 0);
 }
 
 /**
   * Application or kernel level task create to setup system call
   */
 PID Task_Create( voidfuncptr f, PRIORITY py, int arg){
+	return Task_CreateWithStack( f, py, arg, WORKSPACE );
+}
+
+/**
+  * Application or kernel level task create with a stack of stackSize bytes
+  * taken from the stack arena. Returns 0 if the task could not be created.
+  */
+PID Task_CreateWithStack( voidfuncptr f, PRIORITY py, int arg, unsigned int stackSize){
 	unsigned int p;
 
 	if (KernelActive) {
 		Disable_Interrupt();
 		Cp->request = CREATE;
-		Cp->code = f;
-		Cp->py = py;
-		Cp->arg = arg;
-		Enter_Kernel();
+		Cp->reqCode = f;
+		Cp->reqPy = py;
+		Cp->reqArg = arg;
+		Cp->reqStack = stackSize;
+		Kernel_Syscall();
 		p = Cp->response;
 	} else { 
 	  /* call the RTOS function directly */
-	  p = Kernel_Create_Task( f, py, arg );
+	  p = Kernel_Create_Task( f, py, arg, stackSize );
+	}
+	return p;
+}
+
+/**
+  * Application or kernel level worker create, the worker stays parked
+  * until it is handed a job with Task_Rearm()
+  */
+PID Task_CreateWorker(PRIORITY py) {
+	return Task_CreateWorkerWithStack( py, WORKSPACE );
+}
+
+/**
+  * Application or kernel level worker create with a stack of stackSize
+  * bytes. Returns 0 if the worker could not be created.
+  */
+PID Task_CreateWorkerWithStack(PRIORITY py, unsigned int stackSize) {
+	unsigned int p;
+
+	if (KernelActive) {
+		Disable_Interrupt();
+		Cp->request = CREATE_WORKER;
+		Cp->reqPy = py;
+		Cp->reqStack = stackSize;
+		Kernel_Syscall();
+		p = Cp->response;
+	} else {
+	  /* call the RTOS function directly */
+	  p = Kernel_Create_Worker( py, stackSize );
+	}
+	return p;
+}
+
+/**
+  * Application or kernel level periodic task create. f is called once
+  * per job, at offset ticks from now and every period ticks after that,
+  * and must return when the job is done. wcet is its worst case execution
+  * time in ticks. Returns 0 if the task could not be created, or if with
+  * it some periodic task could miss a deadline (see OS_Utilisation()).
+  */
+PID Task_CreatePeriodic(voidfuncptr f, PRIORITY py, int arg, TICK period, TICK wcet, TICK offset) {
+	return Task_CreatePeriodicWithStack( f, py, arg, period, wcet, offset, WORKSPACE );
+}
+
+/**
+  * Application or kernel level periodic task create with a stack of
+  * stackSize bytes
+  */
+PID Task_CreatePeriodicWithStack(voidfuncptr f, PRIORITY py, int arg, TICK period, TICK wcet, TICK offset, unsigned int stackSize) {
+	unsigned int p;
+
+	if (KernelActive) {
+		Disable_Interrupt();
+		Cp->request = CREATE_PERIODIC;
+		Cp->reqCode = f;
+		Cp->reqPy = py;
+		Cp->reqArg = arg;
+		Cp->reqPeriod = period;
+		Cp->reqWcet = wcet;
+		Cp->reqOffset = offset;
+		Cp->reqStack = stackSize;
+		Kernel_Syscall();
+		p = Cp->response;
+	} else {
+	  /* call the RTOS function directly */
+	  p = Kernel_Create_Periodic( f, py, arg, period, wcet, offset, stackSize );
+	}
+	return p;
+}
+
+/**
+  * Application or kernel level cyclic executive start. A task of priority
+  * py runs table[i].f at table[i].offset ticks into every hyperperiod,
+  * starting now. Returns 0 if the schedule could not be started.
+  */
+PID Cyclic_Start(const SLOT *table, unsigned int slots, TICK hyperperiod, PRIORITY py, unsigned int stackSize) {
+	unsigned int p;
+
+	if (KernelActive) {
+		Disable_Interrupt();
+		Cp->request = CYCLIC_START;
+		Cp->reqTable = table;
+		Cp->reqCount = slots;
+		Cp->reqPeriod = hyperperiod;
+		Cp->reqPy = py;
+		Cp->reqStack = stackSize;
+		Kernel_Syscall();
+		p = Cp->response;
+	} else {
+	  /* call the RTOS function directly */
+	  p = Kernel_Start_Cyclic( table, slots, hyperperiod, py, stackSize );
 	}
 	return p;
 }
 
+/**
+  * Number of times a slot overran, i.e. was still running or waiting to
+  * run when the next slot was released
+  */
+unsigned int Cyclic_Overruns(unsigned int slot) {
+	unsigned int n;
+	unsigned char sreg = SREG;
+
+	if (slot >= MAXSLOT) {
+		return 0;
+	}
+
+	Disable_Interrupt();
+	n = CyclicOverruns[slot];
+	SREG = sreg;
+
+	return n;
+}
+
+/**
+  * Application level worker rearm to setup system call. The worker runs
+  * f with Task_GetArg() returning arg, and parks again when f returns.
+  */
+int Task_Rearm(PID p, voidfuncptr f, int arg) {
+	if (KernelActive) {
+		Disable_Interrupt();
+		Cp->request = REARM;
+		Cp->pidAction = p;
+		Cp->reqCode = f;
+		Cp->reqArg = arg;
+		Kernel_Syscall();
+		return Cp->response;
+	}
+
+	return 0;
+}
+
 /**
   * Application level task next to setup system call to give up CPU
   */
@@ -821,13 +2852,70 @@ void Task_Sleep(TICK t) {
 	if (KernelActive) {
 		Disable_Interrupt();
 		Cp->request = SLEEP;
-		unsigned int clockTicks = TCNT3/625;
-		Cp->wakeTickOverflow = tickOverflowCount + ((t + clockTicks) / 100);
-		Cp->wakeTick = (t + clockTicks) % 100;
-		Enter_Kernel();
+		Cp->wakeTime = SystemTick + t;
+		Kernel_Syscall();
+	}
+}
+
+/**
+  * Application level task sleep until an absolute time to setup system call
+  */
+void Task_SleepUntil(TIME t) {
+	if (KernelActive) {
+		Disable_Interrupt();
+		Cp->request = SLEEP;
+		Cp->wakeTime = t;
+		Kernel_Syscall();
 	}
 }
 
+/**
+  * Per mille of the CPU needed by the periodic tasks, at their wcet, and by
+  * the tick ISR and context switches, at the longest measured so far. Above
+  * 1000 some deadline will be missed. Tasks that are not periodic and the
+  * cyclic executive are not counted.
+  */
+unsigned int OS_Utilisation() {
+	unsigned int u;
+	unsigned char sreg = SREG;
+
+	Disable_Interrupt();
+	u = Kernel_Utilisation();
+	SREG = sreg;
+
+	return u;
+}
+
+/**
+  * Registers h to be called, inside the kernel with interrupts disabled,
+  * each time a periodic job misses its deadline (JOB_LATE) or runs past
+  * its wcet (JOB_OVERRUN). Lateness is noticed at a tick the late job runs
+  * at, or when it finishes. h runs on the stack of the task at fault or on
+  * the kernel stack, and must not make system calls; if it returns
+  * non-zero the task is demoted to MINPRIORITY. NULL only counts faults.
+  */
+void OS_SetMissHandler(missfuncptr h) {
+	unsigned char sreg = SREG;
+
+	Disable_Interrupt();
+	MissHandler = h;
+	SREG = sreg;
+}
+
+/**
+  * Returns the current system time, read atomically
+  */
+TIME Now() {
+	TIME t;
+	unsigned char sreg = SREG;
+
+	Disable_Interrupt();
+	t = SystemTick;
+	SREG = sreg;
+
+	return t;
+}
+
 /**
   * Application level task suspend to setup system call
   */
@@ -836,7 +2924,7 @@ void Task_Suspend(PID p) {
 		Disable_Interrupt();
 		Cp->request = SUSPEND;
 		Cp->pidAction = p;
-		Enter_Kernel();
+		Kernel_Syscall();
 	}
 }
 
@@ -848,7 +2936,7 @@ void Task_Resume(PID p) {
 		Disable_Interrupt();
 		Cp->request = RESUME;
 		Cp->pidAction = p;
-		Enter_Kernel();
+		Kernel_Syscall();
 	}
 }
 
@@ -864,6 +2952,59 @@ void Task_Terminate() {
 	}
 }
 
+/**
+  * Returns the most bytes of its stack that task p has ever used,
+  * 0 if there is no such task
+  */
+unsigned int Task_StackHighWater(PID p) {
+	volatile PD *pd;
+	unsigned int unused = 0;
+	unsigned int size = 0;
+	unsigned char sreg = SREG;
+
+	Disable_Interrupt();
+
+	pd = Kernel_Find_Task(p);
+
+	if (pd != NULL) {
+		size = pd->stackSize;
+
+		while ((STACKGUARD + unused < size) && (pd->workSpace[STACKGUARD + unused] == STACKPAINT)) {
+			unused++;
+		}
+
+		size -= STACKGUARD + unused;
+	}
+
+	SREG = sreg;
+
+	return size;
+}
+
+/**
+  * Copies the timing of the last job periodic task p finished, and its
+  * deadline miss and overrun counts, into s. Returns 0 if p is not a
+  * periodic task.
+  */
+int Task_JobStats(PID p, JOBSTATS *s) {
+	volatile PD *pd;
+	int found = 0;
+	unsigned char sreg = SREG;
+
+	Disable_Interrupt();
+
+	pd = Kernel_Find_Task(p);
+
+	if ((pd != NULL) && (pd->period > 0)) {
+		*s = pd->stats;
+		found = 1;
+	}
+
+	SREG = sreg;
+
+	return found;
+}
+
 /**
   * Application level task getarg to return intiial arg value
   */
@@ -900,7 +3041,7 @@ void setup() {
 
 	TCNT1 = 0;                  /** Initialize counter to 0 */
 
-	OCR1A = 624;                /** Compare match register (TOP comparison value) [(16MHz/(100Hz*8)] - 1 */
+	OCR1A = TICKCOUNT - 1;      /** Compare match register (TOP comparison value) [16MHz/(100Hz*256)] - 1 */
 
 	TCCR1B |= (1 << WGM12);     /** Turns on CTC mode (TOP is now OCR1A) */
 
@@ -908,49 +3049,60 @@ void setup() {
 
 	TIMSK1 |= (1 << OCIE1A);    /** Enable timer compare interrupt */
 
-	/** Timer 3 */
-	TCCR3A = 0;                 /** Set TCCR0A register to 0 */
-	TCCR3B = 0;                 /** Set TCCR0B register to 0 */
+	Enable_Interrupt();
+}
 
-	TCNT3 = 0;                  /** Initialize counter to 0 */
+/**
+  * Called by Enter_Kernel_Preempt() from the Timer1 ISR, on the interrupted
+  * task's stack with its full frame saved. Advances the system time and
+  * returns 1 if the interrupted task should be preempted.
+  */
+unsigned char Kernel_Tick() {
+	/** Timer1 restarted at the compare match, but interrupts may have been held off since */
+	unsigned int start = TCNT1;
+#ifdef TICKLESS
+	TIME span = TicklessSpan;
 
-	OCR3A = 62499;              /** Compare match register (TOP comparison value) [(16MHz/(100Hz*8)] - 1 */
+	TicklessSpan = 1;
+	TicklessBase = 0;
+	OCR1A = TICKCOUNT - 1;
 
-	TCCR3B |= (1 << WGM32);     /** Turns on CTC mode (TOP is now OCR1A) */
+	Kernel_Advance_Time(span);
+#else
+	Kernel_Advance_Time(1);
+#endif
 
-	TCCR3B |= (1 << CS32);      /** Prescaler 1024 */
+	if (!KernelActive) {
+		return 0;
+	}
 
-	TIMSK3 = (1 << OCIE3A);
+	/** The tick's own work only, not the latency before it or the miss handler */
+	Kernel_Measure(&TickCost, start);
 
-	Enable_Interrupt();
-}
+	Kernel_Check_Job();
 
-/**
-  * ISR for timer1
-  */
-ISR(TIMER1_COMPA_vect) {
+	/** The ISR ran on Cp's stack, catch an overflow before the next switch does */
+	Kernel_Check_Stack(Cp);
 
-	volatile int i;
+	/** Only switch if a task of higher or equal (round robin) priority is ready */
+	if (Kernel_Ready_Before(1)) {
+		return 1;
+	}
 
-	for (i = SQCount-1; i >= 0; i--) {
-		if ((SleepQueue[i]->wakeTickOverflow <= tickOverflowCount) && (SleepQueue[i]->wakeTick <= (TCNT3/625))) {
-			volatile PD *p = dequeue(&SleepQueue, &SQCount);
-			p->state = READY;
-			enqueueRQ(&p, &ReadyQueue, &RQCount);
-		}
-		else {
-			break;
-		}
+#ifdef TICKLESS
+	if (Cp == IdleTask) {
+		Kernel_Enter_Tickless();
 	}
+#endif
 
-	Task_Next();
+	return 0;
 }
 
 /**
-  * ISR for timer3
+  * ISR for timer1, the context save is done in cswitch.S
   */
-ISR(TIMER3_COMPA_vect) {
-	tickOverflowCount += 1;
+ISR(TIMER1_COMPA_vect, ISR_NAKED) {
+	asm volatile ("jmp Enter_Kernel_Preempt" ::);
 }
 
 /**
@@ -2,12 +2,42 @@
 #define _OS_H_
    
 #define MAXTHREAD     16
-#define WORKSPACE     256   /** in bytes, per THREAD */
+#define WORKSPACE     256   /** default stack size in bytes, per THREAD */
+#define STACKARENA    3072  /** bytes shared by the stacks of all threads */
+#define ISRSTACK      128   /** bytes of every stack kept for interrupts, see below */
+#define MINSTACK      (ISRSTACK + 32)   /** smallest stack a thread can be given */
 #define MAXMUTEX      8
 #define MAXEVENT      8
+#define MAXQUEUE      4
+#define MAXSEM        8
+#define MAXGROUP      4
+#define MAXSLOT       8    /** slots in a cyclic executive schedule */
 #define MSECPERTICK   10   /** resolution of a system tick in milliseconds */
 #define MINPRIORITY   10   /** 0 is the highest priority, 10 the lowest */
 
+/**
+  * The Timer1, UART and ADC interrupts run on the stack of the task they
+  * interrupt, and so does the kernel work they do. Direct system calls
+  * run on the caller's stack too. They cannot nest, because both run
+  * with interrupts disabled. The deepest path, counted by hand, is the
+  * tick readying a task and re-sorting the ready queue, or calling the
+  * miss handler:
+  *   full frame and tag                      35
+  *   interrupt and Kernel_Tick returns        6
+  *   Kernel_Tick, Kernel_Advance_Time,
+  *   Kernel_Update_Priority, Kernel_Set_Priority,
+  *   enqueueRQ and the heap sift             ~55
+  *   miss handler, if it calls little         ~20
+  * That is about 115 bytes, rounded up to ISRSTACK. A stack needs ISRSTACK
+  * plus the most the task itself uses. Check it on the target with
+  * Task_StackHighWater().
+  */
+
+//Uncomment the following line to schedule periodic tasks earliest deadline first.
+//#define EDF
+
+#define EDFPRIORITY   1    /** under EDF, the ready level every periodic task shares */
+
 
 #ifndef NULL
 #define NULL          0   /** undefined */
@@ -22,8 +52,32 @@ typedef unsigned int PID;        /** always non-zero if it is valid */
 typedef unsigned int MUTEX;      /** always non-zero if it is valid */
 typedef unsigned int PRIORITY;
 typedef unsigned int EVENT;      /** always non-zero if it is valid */
+typedef unsigned int QUEUE;      /** always non-zero if it is valid */
+typedef unsigned int SEMAPHORE;  /** always non-zero if it is valid */
+typedef unsigned int EVENTGROUP; /** always non-zero if it is valid */
+typedef int (*missfuncptr) (PID p, unsigned int kind);   /** see OS_SetMissHandler() */
+
+/** EventGroup_Wait() modes, EG_CLEAR may be or'ed with either */
+#define EG_ANY        0x00   /** wake when any of the bits is set */
+#define EG_ALL        0x01   /** wake when all of the bits are set */
+#define EG_CLEAR      0x02   /** clear the bits waited for on wakeup */
 typedef unsigned int TICK;
 
+/**
+  * A timeout of WAIT_FOREVER never runs out, so the longest finite timeout
+  * the *Timeout() calls take is WAIT_FOREVER - 1 ticks
+  */
+#define WAIT_FOREVER  0xFFFF
+typedef unsigned long TIME;      /** absolute system tick count, wraps after 2^32 ticks */
+
+/** Faults of a periodic job passed to the miss handler */
+#define JOB_LATE      0x01   /** not done by the end of its period */
+#define JOB_OVERRUN   0x02   /** ran for longer than its wcet */
+
+/** Wrap-safe ordering of two absolute times */
+#define TIME_BEFORE(a, b)       ((long)((a) - (b)) < 0)
+#define TIME_AFTER(a, b)        TIME_BEFORE(b, a)
+
 /**
   *  This is the set of states that a task can be in at any given time.
   */
@@ -34,7 +88,11 @@ typedef enum process_states {
     SLEEPING,
     BLOCKED_ON_MUTEX,
     WAITING,
-    TERMINATED
+    TERMINATED,
+    PARKED,
+    BLOCKED_ON_QUEUE,
+    BLOCKED_ON_SEM,
+    CYCLIC_IDLE
 } PROCESS_STATES;
 
 /**
@@ -53,9 +111,44 @@ typedef enum kernel_request_type {
     MUTEX_UNLOCK,
     EVENT_INIT,
     EVENT_WAIT,
-    EVENT_SIGNAL
+    EVENT_SIGNAL,
+    SWITCH,
+    CREATE_WORKER,
+    PARK,
+    REARM,
+    QUEUE_INIT,
+    QUEUE_SEND,
+    QUEUE_RECV,
+    EVENT_BROADCAST,
+    SEM_INIT,
+    SEM_WAIT,
+    SEM_POST,
+    GROUP_INIT,
+    GROUP_WAIT,
+    GROUP_SET,
+    GROUP_CLEAR,
+    CREATE_PERIODIC,
+    NEXT_PERIOD,
+    CYCLIC_START,
+    CYCLIC_WAIT
 } KERNEL_REQUEST_TYPE;
 
+/**
+  * This is the set of reasons for the kernel to abort
+  */
+typedef enum abort_reason {
+    ABORT_NONE = 0,
+    ABORT_NO_TASK,
+    ABORT_STACK_OVERFLOW
+} ABORT_REASON;
+
+/**
+  * The tasks blocked on a kernel object, most urgent first. See queue.c.
+  */
+typedef struct WaitList {
+    volatile struct ProcessDescriptor *head;
+} WL;
+
 /**
   *  This is the set of states that a mutex can be in at any given time.
   */
@@ -74,6 +167,10 @@ typedef struct Mutex {
     MUTEX_STATE state;
     PID owner;
     unsigned int lockCount;
+    WL waiters;          /* blocked on the mutex, most urgent first */
+    volatile struct ProcessDescriptor *holder;   /* PD of owner */
+    volatile struct Mutex *nextHeld;             /* next mutex held by the same owner */
+    PRIORITY ceiling;    /* see Mutex_InitCeiling() */
 } MTX;
 
 /**
@@ -92,9 +189,62 @@ typedef enum event_state {
 typedef struct Event {
     EVENT e;
     EVENT_STATE state;
-    PID p;
+    WL waiters;          /* most urgent first */
 } EVT;
 
+/**
+  * Each counting semaphore is represented by a semaphore struct.
+  */
+typedef struct Semaphore {
+    SEMAPHORE s;
+    unsigned int count;  /* units available, 0 while anybody waits */
+    WL waiters;          /* most urgent first */
+} SEM;
+
+/**
+  * Each event group is a set of flags that tasks can wait on together.
+  */
+typedef struct EventGroup {
+    EVENTGROUP g;
+    unsigned int bits;
+    WL waiters;          /* most urgent first */
+} EVG;
+
+/**
+  * Each message queue is a ring of capacity fixed size messages in a
+  * buffer supplied by the application.
+  */
+typedef struct MessageQueue {
+    QUEUE q;
+    unsigned char *buf;
+    unsigned int msgSize;
+    unsigned int capacity;
+    unsigned int head;       /* index of the oldest message */
+    unsigned int count;
+    WL senders;              /* blocked on a full queue */
+    WL receivers;            /* blocked on an empty queue */
+} MQ;
+
+/**
+  * One entry of a cyclic executive schedule, see Cyclic_Start()
+  */
+typedef struct Slot {
+    TICK offset;         /* ticks from the start of the hyperperiod */
+    voidfuncptr f;       /* runs to completion on the executive's stack */
+} SLOT;
+
+/**
+  * Timing of the last job a periodic task finished, and the faults of
+  * all its jobs so far, see Task_JobStats()
+  */
+typedef struct JobStats {
+    TIME release;            /* tick the job was released at */
+    TIME start;              /* tick it was first dispatched */
+    TIME finish;             /* tick it returned */
+    unsigned int misses;     /* jobs not done by the end of their period */
+    unsigned int overruns;   /* jobs that ran for longer than wcet */
+} JOBSTATS;
+
 /**
   * Each task is represented by a process descriptor, which contains all
   * relevant information about this task. For convenience, we also store
@@ -103,41 +253,118 @@ typedef struct Event {
 typedef struct ProcessDescriptor {
     PID p;
     unsigned char *sp;   /* stack pointer into the "workSpace" */
-    unsigned char workSpace[WORKSPACE]; 
+    unsigned char *workSpace;   /* lowest address of the stack, carved from the arena */
+    unsigned int stackSize;
     PROCESS_STATES state;
     PRIORITY py;
     PRIORITY inheritedPy;
     int arg;
     voidfuncptr  code;   /* function to be executed as a task */
     KERNEL_REQUEST_TYPE request;
+    voidfuncptr reqCode; /* arguments of the pending request */
+    PRIORITY reqPy;
+    int reqArg;
+    unsigned int reqStack;
     unsigned int response;
-    TICK wakeTickOverflow;
-    TICK wakeTick;
+    QUEUE q;
+    void *reqMsg;        /* message to send, or where to receive one */
+    unsigned int reqSize;
+    unsigned int reqCount;
+    TICK reqTimeout;     /* ticks a blocking request may wait */
+    TICK reqPeriod;
+    TICK reqWcet;
+    TICK reqOffset;
+    const SLOT *reqTable;
+    TIME wakeTime;       /* absolute tick to wake up at */
+    TIME delta;          /* ticks after the previous sleeper in the sleep queue */
     MUTEX m;
-    EVENT eWait;
     EVENT eSend;
+    SEMAPHORE s;
+    EVENTGROUP g;
+    unsigned int reqBits;   /* event group flags to set, clear or wait for */
+    unsigned int reqMode;
     unsigned int suspended;
     PID pidAction;
+    volatile struct ProcessDescriptor *next;   /* links in the ready queue */
+    volatile struct ProcessDescriptor *prev;
+    volatile struct ProcessDescriptor *sleepNext;   /* links in the sleep queue */
+    volatile struct ProcessDescriptor *sleepPrev;
+    volatile WL *waitList;   /* the wait list the task is blocked on, if any */
+    volatile MTX *blockedOn; /* the mutex the task is blocked on, if any */
+    volatile MTX *held;      /* mutexes the task owns, linked through nextHeld */
+    unsigned int timed;      /* also on the sleep queue until its timeout */
+    TICK period;             /* periodic tasks only, 0 otherwise */
+    TICK wcet;               /* worst case execution time per job */
+    TIME release;            /* absolute tick the current job was released at */
+    TIME deadline;           /* absolute tick the current job is due by */
+    TIME start;              /* tick the current job was first dispatched */
+    unsigned int started;    /* the current job has been dispatched */
+    TICK used;               /* ticks the current job was running at, up to wcet + 1 */
+    unsigned int late;       /* the current job already missed its deadline */
+    JOBSTATS stats;
+    unsigned int heapIndex;  /* position in the EDF ready heap */
 } PD;
 
 // void OS_Init(void);      redefined as main()
 void OS_Abort(void);
+unsigned int OS_Utilisation(void);  // per mille of the CPU periodic tasks and kernel overhead need
+void OS_SetMissHandler(missfuncptr h);   // h returns non-zero to demote the task to MINPRIORITY
 
-PID  Task_Create( void (*f)(void), PRIORITY py, int arg);
+PID  Task_Create( void (*f)(void), PRIORITY py, int arg);   // WORKSPACE bytes of stack
+PID  Task_CreateWithStack( void (*f)(void), PRIORITY py, int arg, unsigned int stackSize);
+PID  Task_CreateWorker(PRIORITY py);   // created PARKED, see Task_Rearm()
+PID  Task_CreateWorkerWithStack(PRIORITY py, unsigned int stackSize);
+int  Task_Rearm(PID p, void (*f)(void), int arg);  // 0 if p is not parked
+PID  Task_CreatePeriodic( void (*f)(void), PRIORITY py, int arg, TICK period, TICK wcet, TICK offset);  // f runs once per period
+PID  Task_CreatePeriodicWithStack( void (*f)(void), PRIORITY py, int arg, TICK period, TICK wcet, TICK offset, unsigned int stackSize);
 void Task_Terminate(void);
 void Task_Next(void); // Same as yield
 int  Task_GetArg();
 void Task_Suspend( PID p );          
 void Task_Resume( PID p );
+unsigned int Task_StackHighWater( PID p );   // most stack bytes ever used by p
+int  Task_JobStats( PID p, JOBSTATS *s );    // 0 if p is not a periodic task
 
 void Task_Sleep(TICK t);  // sleep time is at least t*MSECPERTICK
+void Task_SleepUntil(TIME t);  // returns at once if t has already passed
+
+PID  Cyclic_Start(const SLOT *table, unsigned int slots, TICK hyperperiod, PRIORITY py, unsigned int stackSize);
+unsigned int Cyclic_Overruns(unsigned int slot);
 
-MUTEX Mutex_Init(void);
+TIME Now(void);  // ticks since OS_Start(), one tick is MSECPERTICK ms
+
+MUTEX Mutex_Init(void);                      // priority inheritance
+MUTEX Mutex_InitCeiling(PRIORITY ceiling);   // immediate priority ceiling
 void Mutex_Lock(MUTEX m);
 void Mutex_Unlock(MUTEX m);
+int  Mutex_LockTimeout(MUTEX m, TICK t);     // 0 if m is still taken after t ticks, t < WAIT_FOREVER
 
 EVENT Event_Init(void);
 void Event_Wait(EVENT e);
+int  Event_WaitTimeout(EVENT e, TICK t);     // 0 if e was not signalled within t ticks, t < WAIT_FOREVER
 void Event_Signal(EVENT e);
+void Event_SignalFromISR(EVENT e);   // from interrupt handlers only
+void Event_BroadcastFromISR(EVENT e);   // from interrupt handlers only, wakes every waiter
+void Event_Broadcast(EVENT e);       // wakes every waiter
+
+SEMAPHORE Sem_Init(unsigned int count);
+void Sem_Wait(SEMAPHORE s);
+int  Sem_WaitTimeout(SEMAPHORE s, TICK t);   // 0 if no unit came within t ticks, t < WAIT_FOREVER
+void Sem_Post(SEMAPHORE s);
+void Sem_PostFromISR(SEMAPHORE s);   // from interrupt handlers only
+
+EVENTGROUP EventGroup_Init(void);
+void EventGroup_Set(EVENTGROUP g, unsigned int bits);
+unsigned int EventGroup_Clear(EVENTGROUP g, unsigned int bits);    // returns the flags before
+unsigned int EventGroup_Wait(EVENTGROUP g, unsigned int bits, unsigned int mode);
+unsigned int EventGroup_WaitTimeout(EVENTGROUP g, unsigned int bits, unsigned int mode, TICK t);  // 0 on timeout, t < WAIT_FOREVER
+
+QUEUE Queue_Init(void *buf, unsigned int msgSize, unsigned int capacity);  // buf holds capacity messages
+void Queue_Send(QUEUE q, const void *msg);
+int  Queue_TrySend(QUEUE q, const void *msg);              // 0 if the queue is full
+int  Queue_SendTimeout(QUEUE q, const void *msg, TICK t);  // 0 if still full after t ticks, t < WAIT_FOREVER
+void Queue_Recv(QUEUE q, void *msg);
+int  Queue_TryRecv(QUEUE q, void *msg);                    // 0 if the queue is empty
+int  Queue_RecvTimeout(QUEUE q, void *msg, TICK t);        // 0 if still empty after t ticks, t < WAIT_FOREVER
 
 #endif /* _OS_H_ */
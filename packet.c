@@ -0,0 +1,72 @@
+#include "packet.h"
+
+static uint8_t crc8(const uint8_t *data, uint8_t len)
+{
+	uint8_t crc = 0;
+	uint8_t i;
+
+	while(len--){
+		crc ^= *data++;
+		for(i = 0; i < 8; i++){
+			crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+		}
+	}
+	return crc;
+}
+
+void Packet_Encode(const PACKET *p, uint8_t *frame)
+{
+	uint16_t x = p->x & 0x3FF;
+	uint16_t y = p->y & 0x3FF;
+
+	frame[0] = PACKET_SYNC;
+	frame[1] = p->seq;
+	frame[2] = x >> 2;
+	frame[3] = ((x & 0x03) << 6) | (y >> 4);
+	frame[4] = ((y & 0x0F) << 4) | (p->laser ? 0x08 : 0x00);
+	frame[5] = crc8(&frame[1], 4);
+}
+
+void Packet_DecoderInit(DECODER *d)
+{
+	d->count = 0;
+}
+
+uint8_t Packet_Decode(DECODER *d, uint8_t byte, PACKET *p)
+{
+	uint8_t *f = d->buf;
+	uint8_t i;
+
+	if(d->count == 0){
+		if(byte == PACKET_SYNC){
+			f[d->count++] = byte;
+		}
+		return 0;
+	}
+
+	f[d->count++] = byte;
+	if(d->count < PACKET_SIZE){
+		return 0;
+	}
+
+	/* A whole frame is buffered, start hunting again whatever the outcome */
+	d->count = 0;
+	if(crc8(&f[1], 4) != f[5]){
+		/* Locked on a payload byte, resume from the next buffered sync */
+		for(i = 1; i < PACKET_SIZE; i++){
+			if(f[i] == PACKET_SYNC){
+				break;
+			}
+		}
+		while(i < PACKET_SIZE){
+			f[d->count++] = f[i++];
+		}
+		return 0;
+	}
+
+	p->seq   = f[1];
+	p->x     = ((uint16_t)f[2] << 2) | (f[3] >> 6);
+	p->y     = ((uint16_t)(f[3] & 0x3F) << 4) | (f[4] >> 4);
+	p->laser = (f[4] & 0x08) ? 1 : 0;
+	return 1;
+}
@@ -0,0 +1,34 @@
+#ifndef PACKET_H_
+#define PACKET_H_
+
+#include <stdint.h>
+
+/*
+ * Base to remote frame, 6 bytes:
+ *   sync | seq | x[9:2] | x[1:0] y[9:4] | y[3:0] laser 000 | crc
+ * The CRC-8 (polynomial 0x07) covers seq and the three payload bytes.
+ */
+#define PACKET_SYNC 0xA5
+#define PACKET_SIZE 6
+
+typedef struct {
+	uint8_t seq;
+	uint16_t x;         // 10-bit joystick axes
+	uint16_t y;
+	uint8_t laser;      // non-zero fires the laser
+} PACKET;
+
+typedef struct {
+	uint8_t count;      // bytes of the current frame seen, 0 while hunting for sync
+	uint8_t buf[PACKET_SIZE];
+} DECODER;
+
+void Packet_Encode(const PACKET *p, uint8_t *frame);
+
+// Zero-initialised decoders are ready to use
+void Packet_DecoderInit(DECODER *d);
+
+// Feed one received byte, returns 1 and fills p when a valid frame completes
+uint8_t Packet_Decode(DECODER *d, uint8_t byte, PACKET *p);
+
+#endif /* PACKET_H_ */
@@ -0,0 +1,77 @@
+/*
+ * Host-side test of the Bluetooth frame decoder, build and run with
+ * "make test". Needs nothing from the AVR toolchain.
+ */
+#include <stdio.h>
+#include "packet.h"
+
+#define FRAMES 50
+
+static int failures = 0;
+
+static void check(int ok, const char *what)
+{
+	if(!ok){
+		printf("FAIL: %s\n", what);
+		failures++;
+	}
+}
+
+/* Encode n copies of p, numbered from 0, into stream */
+static int encode_stream(const PACKET *p, uint8_t *stream, int n)
+{
+	PACKET q = *p;
+	int i;
+
+	for(i = 0; i < n; i++){
+		q.seq = i;
+		Packet_Encode(&q, &stream[i * PACKET_SIZE]);
+	}
+	return n * PACKET_SIZE;
+}
+
+/* Count the frames decoded from len bytes of stream, all must match p */
+static int decode_stream(const PACKET *p, const uint8_t *stream, int len)
+{
+	DECODER d;
+	PACKET out;
+	int frames = 0;
+	int i;
+
+	Packet_DecoderInit(&d);
+	for(i = 0; i < len; i++){
+		if(Packet_Decode(&d, stream[i], &out)){
+			check(out.x == p->x && out.y == p->y && out.laser == p->laser, "decoded payload");
+			frames++;
+		}
+	}
+	return frames;
+}
+
+int main(void)
+{
+	uint8_t stream[FRAMES * PACKET_SIZE];
+	PACKET p = {0, 512, 300, 1};
+	int len;
+
+	/* Aligned stream, every frame comes out */
+	len = encode_stream(&p, stream, FRAMES);
+	check(decode_stream(&p, stream, len) == FRAMES, "aligned stream");
+
+	/* x = 660 puts PACKET_SYNC in the first payload byte */
+	p.x = 660;
+	len = encode_stream(&p, stream, FRAMES);
+	check(stream[2] == PACKET_SYNC, "payload byte equals sync");
+
+	/* Start right after a sync so the decoder first locks on the payload byte */
+	check(decode_stream(&p, &stream[1], len - 1) == FRAMES - 1, "stream misaligned on a sync payload byte");
+
+	/* A corrupted frame costs only itself */
+	stream[3 * PACKET_SIZE + 4] ^= 0x10;
+	check(decode_stream(&p, stream, len) == FRAMES - 1, "one corrupted frame");
+
+	if(failures == 0){
+		printf("packet_test: all passed\n");
+	}
+	return failures != 0;
+}
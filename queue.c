@@ -1,147 +1,339 @@
 #include "queue.h"
 
 /*
- *  Checks if queue is full
+ *  Insert into the delta list, p->delta holds the number of ticks to sleep
+ *  on entry and is rebased onto the tasks in front of it
  */
-volatile int isFull(volatile int *QCount) {
-    return *QCount == MAXTHREAD - 1;
+void enqueueSQ(volatile PD **p, volatile SQ *Queue) {
+    volatile PD *new = *p;
+    volatile PD *prev = NULL;
+    volatile PD *curr = Queue->head;
+
+    while(curr != NULL && curr->delta <= new->delta) {
+        new->delta -= curr->delta;
+        prev = curr;
+        curr = curr->sleepNext;
+    }
+
+    new->sleepPrev = prev;
+    new->sleepNext = curr;
+
+    if(curr != NULL) {
+        curr->delta -= new->delta;
+        curr->sleepPrev = new;
+    }
+
+    if(prev == NULL) {
+        Queue->head = new;
+    }
+    else {
+        prev->sleepNext = new;
+    }
 }
 
 /*
- *  Checks if queue is empty, READY QUEUE SHOULD NEVER BE EMPTY
+ *  Unlink a task from anywhere in the delta list, handing its remaining
+ *  ticks on to the task behind it
  */
-volatile int isEmpty(volatile int *QCount) {
-    return *QCount == 0;
+void removeSQ(volatile PD **p, volatile SQ *Queue) {
+    volatile PD *old = *p;
+
+    if(old->sleepNext != NULL) {
+        old->sleepNext->delta += old->delta;
+        old->sleepNext->sleepPrev = old->sleepPrev;
+    }
+
+    if(old->sleepPrev == NULL) {
+        Queue->head = old->sleepNext;
+    }
+    else {
+        old->sleepPrev->sleepNext = old->sleepNext;
+    }
+
+    old->sleepNext = NULL;
+    old->sleepPrev = NULL;
 }
 
-void enqueueWQ(volatile PD **p, volatile PD **Queue, volatile int *QCount) {
-    if(isFull(QCount)) {
-        return;
+/*
+ *  Account for n elapsed ticks, for a single tick only the head is touched
+ */
+void tickSQ(volatile SQ *Queue, TIME n) {
+    volatile PD *curr = Queue->head;
+
+    while(curr != NULL && n > 0) {
+        if(curr->delta >= n) {
+            curr->delta -= n;
+            break;
+        }
+
+        n -= curr->delta;
+        curr->delta = 0;
+        curr = curr->sleepNext;
     }
+}
 
-    int i = (*QCount) - 1;
+/*
+ *  Return the head of the sleep queue if it is due, NULL otherwise
+ */
+volatile PD *dequeueSQ(volatile SQ *Queue) {
+    volatile PD *result = Queue->head;
 
-    while(i >= 0) {
-        Queue[i+1] = Queue[i];
-        i--;
+    if(result == NULL || result->delta > 0) {
+        return NULL;
     }
 
-    Queue[i+1] = *p;
-    (*QCount)++;
+    removeSQ(&result, Queue);
+
+    return result;
 }
 
-void enqueueSQ(volatile PD **p, volatile PD **Queue, volatile int *QCount) {
-    if(isFull(QCount)) {
-        return;
+#ifdef EDF
+/*
+ *  Deadline order of the EDF heap. Tasks without a period only get to this
+ *  level by inheriting it, and go before every periodic task.
+ */
+int earlierRQ(volatile PD *a, volatile PD *b) {
+    if(a->period == 0) {
+        return b->period != 0;
+    }
+
+    if(b->period == 0) {
+        return 0;
+    }
+
+    return TIME_BEFORE(a->deadline, b->deadline);
+}
+
+static void placeHeap(volatile RQ *Queue, volatile PD *p, unsigned int i) {
+    Queue->heap[i] = p;
+    p->heapIndex = i;
+}
+
+static void siftUpHeap(volatile RQ *Queue, unsigned int i) {
+    volatile PD *p = Queue->heap[i];
+
+    while(i > 0 && earlierRQ(p, Queue->heap[(i - 1) / 2])) {
+        placeHeap(Queue, Queue->heap[(i - 1) / 2], i);
+        i = (i - 1) / 2;
     }
 
-    int i = (*QCount) - 1;
+    placeHeap(Queue, p, i);
+}
+
+static void siftDownHeap(volatile RQ *Queue, unsigned int i) {
+    volatile PD *p = Queue->heap[i];
+    unsigned int child;
+
+    while((child = (2 * i) + 1) < Queue->heapCount) {
+        if(child + 1 < Queue->heapCount && earlierRQ(Queue->heap[child + 1], Queue->heap[child])) {
+            child++;
+        }
+
+        if(!earlierRQ(Queue->heap[child], p)) {
+            break;
+        }
 
+        placeHeap(Queue, Queue->heap[child], i);
+        i = child;
+    }
+
+    placeHeap(Queue, p, i);
+}
+#endif
+
+/*
+ *  Append to the tail of the list for the task's current priority
+ */
+void enqueueRQ(volatile PD **p, volatile RQ *Queue) {
     volatile PD *new = *p;
+    PRIORITY py = new->inheritedPy;
 
-    volatile PD *temp = Queue[i];
+#ifdef EDF
+    if(py == EDFPRIORITY) {
+        placeHeap(Queue, new, Queue->heapCount++);
+        siftUpHeap(Queue, new->heapIndex);
+        Queue->bitmap |= (1 << py);
+        return;
+    }
+#endif
 
-    while(i >= 0 && ((new->wakeTickOverflow > temp->wakeTickOverflow) || ((new->wakeTickOverflow >= temp->wakeTickOverflow) && (new->wakeTick >= temp->wakeTick)))) {
-        Queue[i+1] = Queue[i];
-        i--;
-        temp = Queue[i];
+    new->next = NULL;
+    new->prev = Queue->tail[py];
+
+    if(Queue->tail[py] == NULL) {
+        Queue->head[py] = new;
+        Queue->bitmap |= (1 << py);
+    }
+    else {
+        Queue->tail[py]->next = new;
     }
 
-    Queue[i+1] = *p;
-    (*QCount)++;
+    Queue->tail[py] = new;
 }
 
 /*
- *  Insert into the queue sorted by priority
+ *  Unlink a task from anywhere in its priority list
  */
-void enqueueRQ(volatile PD **p, volatile PD **Queue, volatile int *QCount) {
-    if(isFull(QCount)) {
+void removeRQ(volatile PD **p, volatile RQ *Queue) {
+    volatile PD *old = *p;
+    PRIORITY py = old->inheritedPy;
+
+#ifdef EDF
+    if(py == EDFPRIORITY) {
+        unsigned int i = old->heapIndex;
+        volatile PD *last = Queue->heap[--Queue->heapCount];
+
+        /* Fill the hole with the last element and restore the heap order */
+        if(last != old) {
+            placeHeap(Queue, last, i);
+            siftUpHeap(Queue, i);
+            siftDownHeap(Queue, last->heapIndex);
+        }
+
+        if(Queue->heapCount == 0) {
+            Queue->bitmap &= ~(1 << py);
+        }
         return;
     }
+#endif
 
-    int i = (*QCount) - 1;
+    if(old->prev == NULL) {
+        Queue->head[py] = old->next;
+    }
+    else {
+        old->prev->next = old->next;
+    }
 
-    volatile PD *new = *p;
+    if(old->next == NULL) {
+        Queue->tail[py] = old->prev;
+    }
+    else {
+        old->next->prev = old->prev;
+    }
 
-    volatile PD *temp = Queue[i];
+    if(Queue->head[py] == NULL) {
+        Queue->bitmap &= ~(1 << py);
+    }
+
+    old->next = NULL;
+    old->prev = NULL;
+}
+
+/*
+ *  Lowest set bit of a nibble, 4 if the nibble is empty
+ */
+static const unsigned char lowestBit[16] = {
+    4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0
+};
+
+/*
+ *  Return the highest ready priority, or -1 if nothing is ready
+ */
+int highestRQ(volatile RQ *Queue) {
+    unsigned int map = Queue->bitmap;
+    int py = 0;
+
+    if(map == 0) {
+        return -1;
+    }
+
+    if((map & 0xff) == 0) {
+        map >>= 8;
+        py = 8;
+    }
 
-    while(i >= 0 && (new->inheritedPy >= temp->inheritedPy)) {
-        Queue[i+1] = Queue[i];
-        i--;
-        temp = Queue[i];
+    if((map & 0x0f) == 0) {
+        map >>= 4;
+        py += 4;
     }
 
-    Queue[i+1] = *p;
-    (*QCount)++;
+    return py + lowestBit[map & 0x0f];
 }
 
 /*
- *  Return the first element of the queue with the correct MUTEX m
+ *  Insert behind every waiter of the same or a more urgent priority
  */
-volatile PD *dequeueWQ(volatile PD **Queue, volatile int *QCount, MUTEX m) {
+void enqueueWL(volatile PD **p, volatile WL *List) {
+    volatile PD *new = *p;
+    volatile PD *prev = NULL;
+    volatile PD *curr = List->head;
 
-    if(isEmpty(QCount)) {
-        return NULL;
+    while(curr != NULL && curr->inheritedPy <= new->inheritedPy) {
+        prev = curr;
+        curr = curr->next;
     }
 
-    int i,j;
-    volatile PD* result = NULL;
-    for (i = (*QCount)-1; i>=0; i--) {
-        if(Queue[i]->m == m){
-            result = Queue[i];
-            break;
-        }
+    new->prev = prev;
+    new->next = curr;
+
+    if(curr != NULL) {
+        curr->prev = new;
     }
-    if(result != NULL) {
-        while(i<(*QCount)-1) {
-            Queue[i] = Queue[i+1];
-            i++;
-        }
-        (*QCount)--;
+
+    if(prev == NULL) {
+        List->head = new;
+    }
+    else {
+        prev->next = new;
     }
 
-    return result;
+    new->waitList = List;
 }
 
 /*
- *  Return the first element of the Ready Queue
+ *  Unlink a task from anywhere in a wait list
  */
-volatile PD *dequeueRQ(volatile PD **Queue, volatile int *QCount) {
+void removeWL(volatile PD **p, volatile WL *List) {
+    volatile PD *old = *p;
 
-    if(isEmpty(QCount)) {
-        return NULL;
+    if(old->prev == NULL) {
+        List->head = old->next;
+    }
+    else {
+        old->prev->next = old->next;
     }
 
-    int i,j;
-    volatile PD* result = NULL;
-    for (i = (*QCount)-1; i >= 0; i--) {
-        if((Queue[i]->suspended == 0) && (Queue[i]->state == READY)) {
-            result = Queue[i];
-            break;
-        }
+    if(old->next != NULL) {
+        old->next->prev = old->prev;
     }
+
+    old->next = NULL;
+    old->prev = NULL;
+    old->waitList = NULL;
+}
+
+/*
+ *  Return the most urgent waiter, NULL if there is none
+ */
+volatile PD *dequeueWL(volatile WL *List) {
+    volatile PD *result = List->head;
+
     if(result != NULL) {
-        while(i < (*QCount)-1) {
-            Queue[i] = Queue[i+1];
-            i++;
-        }
-        (*QCount)--;
+        removeWL(&result, List);
     }
 
     return result;
 }
 
 /*
- *  Return the first element of the queue
+ *  Return the first task of the highest non-empty priority list
  */
-volatile PD *dequeue(volatile PD **Queue, volatile int *QCount) {
+volatile PD *dequeueRQ(volatile RQ *Queue) {
+    int py = highestRQ(Queue);
 
-    if(isEmpty(QCount)) {
-        return;
+    if(py < 0) {
+        return NULL;
+    }
+
+    volatile PD *result = Queue->head[py];
+
+#ifdef EDF
+    if(py == EDFPRIORITY) {
+        result = Queue->heap[0];
     }
+#endif
 
-    volatile PD *result = (Queue[(*QCount)-1]);
-    (*QCount)--;
+    removeRQ(&result, Queue);
 
     return result;
 }
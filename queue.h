@@ -3,20 +3,60 @@
 
 #include "os.h"
 
-volatile int isFull(volatile int *QCount);
-volatile int isEmpty(volatile int *QCount);
-void enqueueSQ(volatile PD **p, volatile PD **Queue, volatile int *QCount);
-void enqueueRQ(volatile PD **p, volatile PD **Queue, volatile int *QCount);
-volatile PD *dequeueRQ(volatile PD **Queue, volatile int *QCount);
-volatile PD *dequeue(volatile PD **Queue, volatile int *QCount);
+#define IDLEPRIORITY    (MINPRIORITY + 1)   /** below every application task */
+#define PRIORITYLEVELS  (IDLEPRIORITY + 1)  /** one ready list per priority */
 
-extern volatile PD *ReadyQueue[MAXTHREAD];
-extern volatile int RQCount;
+#if PRIORITYLEVELS > 16
+#error "The ready queue bitmap holds at most 16 priority levels"
+#endif
 
-extern volatile PD *SleepQueue[MAXTHREAD];
-extern volatile int SQCount;
+/*
+ *  The ready queue keeps one FIFO list per priority level. Bit i of
+ *  bitmap is set whenever list i is non-empty, so insert, remove and
+ *  picking the highest priority are all constant time. Under EDF the
+ *  EDFPRIORITY level is a binary heap ordered by deadline instead, which
+ *  makes its insert and remove O(log n).
+ */
+typedef struct ReadyList {
+    volatile PD *head[PRIORITYLEVELS];
+    volatile PD *tail[PRIORITYLEVELS];
+    unsigned int bitmap;
+#ifdef EDF
+    volatile PD *heap[MAXTHREAD];   /* EDFPRIORITY, earliest deadline at heap[0] */
+    unsigned int heapCount;
+#endif
+} RQ;
 
-extern volatile PD *WaitingQueue[MAXTHREAD];
-extern volatile int WQCount;
+/*
+ *  The sleep queue is a delta list: each task stores the number of ticks
+ *  after the task in front of it, so a tick only touches the head.
+ */
+typedef struct SleepList {
+    volatile PD *head;
+} SQ;
+
+/*
+ *  Wait lists are ordered by priority, FIFO within a priority, and are
+ *  linked through the ready queue links: a blocked task is never ready.
+ */
+void enqueueWL(volatile PD **p, volatile WL *List);
+void removeWL(volatile PD **p, volatile WL *List);
+volatile PD *dequeueWL(volatile WL *List);
+
+void enqueueSQ(volatile PD **p, volatile SQ *Queue);
+void removeSQ(volatile PD **p, volatile SQ *Queue);
+void tickSQ(volatile SQ *Queue, TIME n);
+volatile PD *dequeueSQ(volatile SQ *Queue);
+void enqueueRQ(volatile PD **p, volatile RQ *Queue);
+void removeRQ(volatile PD **p, volatile RQ *Queue);
+volatile PD *dequeueRQ(volatile RQ *Queue);
+int highestRQ(volatile RQ *Queue);
+#ifdef EDF
+int earlierRQ(volatile PD *a, volatile PD *b);
+#endif
+
+extern volatile RQ ReadyQueue;
+
+extern volatile SQ SleepQueue;
 
 #endif /* _QUEUE_H_ */
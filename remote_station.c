@@ -13,25 +13,46 @@
 
 #include "uart.h"
 #include "adc.h"
+#include "packet.h"
 #include <avr/io.h>
 #include <util/delay.h>
 #include <stdio.h>
 #include "os.h"
 
-volatile int servo_x   = 0;
-volatile int servo_y   = 0;
-volatile int laser_val = 0;
-
-volatile int man_move_avail   = 0;
-
 volatile int avoid_move_avail = 0;
 volatile int wall_detected    = 0;
 volatile int bump_detected    = 0;
 
-
-volatile int auto_mode        = 0;
 volatile int auto_move_count  = 0;
 
+// Light sensor for hit detection, the only scanned ADC channel
+const uint8_t light_channel = 0;
+
+// Bluetooth frame decoder, only touched by packet_recv
+DECODER bt_decoder;
+
+// Decoded joystick commands from packet_recv to control_roomba
+#define COMMANDS  4
+PACKET command_buf[COMMANDS];
+QUEUE command_queue;
+
+// Each worker sets its bit, passed as its argument, when its job is done
+#define HIT_DETECT_DONE      0x01
+#define CONTROL_ROOMBA_DONE  0x02
+EVENTGROUP workers_done;
+
+// Workers are created once and re-armed every cycle
+PID hit_detect_pid;
+PID control_roomba_pid;
+
+// The control cycle runs every 100 ms
+#define ACTION_PERIOD  (100 / MSECPERTICK)
+#define ACTION_WCET    2
+
+// Control cycles without a command before the roomba is stopped
+#define LINK_TIMEOUT   (500 / (ACTION_PERIOD * MSECPERTICK))
+volatile int empty_cycles = 0;
+
 #define STRAIGHT  32768
 #define FORWARD   250
 #define BACKWARD  -250
@@ -46,13 +67,6 @@ void roomba_data_request(uint8_t request1, uint8_t request2) {
   uart0_sendbyte(request2);
 }
 
-/* Create loop function which executes while scheduler sleeps
- *
- */
-void loop(){
-  while(1){};
-}
-
 void drive_roomba(int16_t velocity, int16_t radius) {
   uart0_sendbyte(DRIVE);
   uart0_sendbyte(velocity>>8);
@@ -80,24 +94,24 @@ void auto_move(){
 void avoid_move(){
 }
 
-void man_move(){
+void man_move(const PACKET *command){
   int radius    = 0;
   int velocity  = 0;
   
-  if(servo_x > 700){
+  if(command->x > 700){
     velocity = FORWARD;
-  }else if(servo_x < 300){
+  }else if(command->x < 300){
     velocity = BACKWARD;
   }
 
-  if(servo_y > 700){
+  if(command->y > 700){
     if(!velocity){
       velocity = FORWARD;
       radius = -TIGHTTURN;
     }else{
       radius =  -WIDETURN;
     }
-  }else if(servo_y < 300){
+  }else if(command->y < 300){
     if(!velocity){
       velocity = FORWARD;
       radius = TIGHTTURN;
@@ -112,20 +126,46 @@ void man_move(){
 }
 
 void control_roomba(){
+  PACKET command;
+
+  // Never wait for a command, the cycle has to finish within ACTION_WCET
+  if(!Queue_TryRecv(command_queue, &command)){
+    // The link dropped, stop rather than keep the last drive command going
+    if(++empty_cycles >= LINK_TIMEOUT){
+      empty_cycles = LINK_TIMEOUT;
+      drive_roomba(0, STRAIGHT);
+      PORTC &= 0x80;
+    }
+
+    EventGroup_Set(workers_done, Task_GetArg());
+    return;
+  }
+  empty_cycles = 0;
+
+  // Skip any commands that piled up behind the newest
+  while(Queue_TryRecv(command_queue, &command));
+
+  // Fire laser if signaled
+  if(command.laser){
+    PORTC |= 0x40;
+  }else{
+    PORTC &= 0x80;
+  }
+
+  // A centred joystick hands control back to the autonomous moves
   if(avoid_move_avail){
     avoid_move();
-  }else if(man_move_avail){
-    man_move();
-  }else{
+  }else if(command.x>300 && command.x<700 && command.y>300 && command.y<700){
     auto_move();
+  }else{
+    man_move(&command);
   }
 
-  Event_Signal(Task_GetArg());
-  Task_Terminate();
+  EventGroup_Set(workers_done, Task_GetArg());
 }
 
 void hit_detection(){
-  int light_level = readadc(0);
+  int light_level = LatestADC(0);
   
   if(light_level > THRESHOLD){
     while(1){
@@ -133,90 +173,31 @@ void hit_detection(){
     }
   }
 
-  Event_Signal(Task_GetArg());
-  Task_Terminate();
+  EventGroup_Set(workers_done, Task_GetArg());
 }
 
 void packet_recv() {
-  char values[50];
-  char curr;
-  volatile int bytes = -1;
-
-  for(;;){  
-    curr = uart1_recvbyte();
-
-    if(bytes == -1 && curr=='#'){
-      bytes = bytes + 1;
-    }else if(bytes != -1 && curr!='#'){
-      values[bytes] = curr;
-      bytes = bytes + 1;
-    }else if(bytes != -1 && curr=='#'){
-      values[bytes] = '\0';
-      break;
-    }    
-  }
-
-  char *token;
-  const char s[2] = "-";
-
-  // Tokenize and convert values to corresponding values
-  token = strtok(values, s);
-  servo_x = atoi(token);
-  
-  token = strtok(NULL, s);
-  servo_y = atoi(token);
+  PACKET packet;
 
-  token = strtok(NULL, s);
-  laser_val = atoi(token);
+  for(;;){
+    // Feed the decoder until a frame with a good CRC comes out
+    while(!Packet_Decode(&bt_decoder, uart1_recvbyte(), &packet));
 
-  // If the value is greater than a range 
-  if(servo_x>300 && servo_x<700 && servo_y>300 && servo_y<700){
-    man_move_avail = 0;
-    auto_mode      = 1;
-  }else{
-    man_move_avail = 1;
-    auto_mode      = 0;
+    Queue_Send(command_queue, &packet);
   }
-
-  // Fire laser if signaled
-  if(laser_val<100){
-    PORTC |= 0x40;
-  }else{
-    PORTC &= 0x80;
-  }
-  
-  Event_Signal(Task_GetArg());
-  Task_Terminate();
 }
 
 /*
  * action
- * Handles creating the tasks and scheduling the output
+ * One control cycle, released every ACTION_PERIOD ticks
  *
  */
 void action(){
-  // Create the events which correspond with each task
-  int packet_recv_eid     = Event_Init();
-  int hit_detect_eid= Event_Init();
-  int control_roomba_eid  = Event_Init();
-  
-  // Begin looping through
-  for(;;){
-    // Receive Packet
-    Task_Create(packet_recv, 2, packet_recv_eid);
-    Task_Create(hit_detection, 2, hit_detect_eid);
-    
-    Event_Wait(hit_detect_eid);
-    Event_Wait(packet_recv_eid);
-
-    // Drive the roomba and write to the laser
-    Task_Create(control_roomba, 2, control_roomba_eid);
-    Event_Wait(control_roomba_eid);
-
-    _delay_ms(100);
-  }
+  // Check for hits while driving the roomba and writing to the laser
+  Task_Rearm(hit_detect_pid, hit_detection, HIT_DETECT_DONE);
+  Task_Rearm(control_roomba_pid, control_roomba, CONTROL_ROOMBA_DONE);
 
-  Task_Terminate();
+  EventGroup_Wait(workers_done, HIT_DETECT_DONE | CONTROL_ROOMBA_DONE, EG_ALL | EG_CLEAR);
 }
 
 void roomba_init() {
@@ -259,6 +240,7 @@ void roomba_init() {
 void a_main(){
   //Begin the ADC for the hit detection
   InitADC();
+  StartADCScan(&light_channel, 1);
 
   // Initialize Uart 0 which is used for the roomba
   uart0_init();
@@ -271,7 +253,18 @@ void a_main(){
   // Initialize the Roomba connection
   roomba_init();
 
-  Task_Create(action, 1, 0);
+  workers_done = EventGroup_Init();
+
+  command_queue = Queue_Init(command_buf, sizeof(PACKET), COMMANDS);
+
+  // The receiver runs on its own and queues every command it decodes
+  // Every stack holds ISRSTACK for interrupts on top of the task's own use
+  Task_CreateWithStack(packet_recv, 2, 0, ISRSTACK + 64);
+
+  hit_detect_pid      = Task_CreateWorkerWithStack(2, MINSTACK);
+  control_roomba_pid  = Task_CreateWorkerWithStack(2, ISRSTACK + 64);  // command copy
+
+  Task_CreatePeriodicWithStack(action, 1, 0, ACTION_PERIOD, ACTION_WCET, 0, MINSTACK);
 
   Task_Terminate();
 }
@@ -1,34 +1,140 @@
 #include "uart.h"
+#include <avr/interrupt.h>
+#include "os.h"
 #define BT_BAUDRATE 19200
 #define F_CPU 16000000UL
 #define BT_UBRR (F_CPU/(16UL*BT_BAUDRATE)) - 1
 
+/*
+ * Each port has an RX and a TX ring. The ISR is the only writer of the RX
+ * head and the TX tail, the task the only writer of the others, so no locks
+ * are needed as long as one task uses each direction of a port.
+ */
+typedef struct {
+  volatile uint8_t buf[UART_BUFFER];
+  volatile uint8_t head;  /* next slot to write */
+  volatile uint8_t tail;  /* next slot to read */
+  EVENT e;                /* signalled when the ring stops being empty/full */
+} RING;
+
+static RING rx0, tx0, rx1, tx1;
+
+#define RING_EMPTY(r) ((r)->head == (r)->tail)
+#define RING_FULL(r)  (RING_NEXT((r)->head) == (r)->tail)
+#define RING_NEXT(i)  ((uint8_t)((i) + 1) & (UART_BUFFER-1))
+
+/* Called from the RX ISRs */
+static void ring_rx(RING *r, uint8_t data){
+  uint8_t was_empty = RING_EMPTY(r);
+
+  if(RING_FULL(r)){
+    return;   /* overrun, drop the byte */
+  }
+
+  r->buf[r->head] = data;
+  r->head = RING_NEXT(r->head);
+
+  if(was_empty){
+    Event_SignalFromISR(r->e);
+  }
+}
+
+/* Called from the UDRE ISRs, returns 0 and stops when there is nothing left */
+static uint8_t ring_tx(RING *r, volatile uint8_t *udr){
+  uint8_t was_full = RING_FULL(r);
+
+  if(RING_EMPTY(r)){
+    return 0;
+  }
+
+  *udr = r->buf[r->tail];
+  r->tail = RING_NEXT(r->tail);
+
+  if(was_full){
+    Event_SignalFromISR(r->e);
+  }
+  return 1;
+}
+
+static void ring_init(RING *r){
+  r->head = 0;
+  r->tail = 0;
+  r->e = Event_Init();
+}
+
+static void ring_put(RING *r, uint8_t data){
+  while(RING_FULL(r)){
+    Event_Wait(r->e);
+  }
+
+  r->buf[r->head] = data;
+  r->head = RING_NEXT(r->head);
+}
+
+static uint8_t ring_get(RING *r){
+  uint8_t data;
+
+  while(RING_EMPTY(r)){
+    Event_Wait(r->e);
+  }
+
+  data = r->buf[r->tail];
+  r->tail = RING_NEXT(r->tail);
+  return data;
+}
+
+ISR(USART0_RX_vect){
+  ring_rx(&rx0, UDR0);
+}
+
+ISR(USART0_UDRE_vect){
+  if(!ring_tx(&tx0, &UDR0)){
+    UCSR0B &= ~(_BV(UDRIE0));
+  }
+}
+
+ISR(USART1_RX_vect){
+  ring_rx(&rx1, UDR1);
+}
+
+ISR(USART1_UDRE_vect){
+  if(!ring_tx(&tx1, &UDR1)){
+    UCSR1B &= ~(_BV(UDRIE1));
+  }
+}
+
+/* Must be called from a task, the rings block on kernel events */
 void uart0_init(void) {
+  ring_init(&rx0);
+  ring_init(&tx0);
+
   UBRR0 = 51;
   
   UCSR0A &= ~(_BV(U2X0));
 
   UCSR0C = _BV(UCSZ01) | _BV(UCSZ00); /* 8-bit data */
-  UCSR0B = _BV(RXEN0) | _BV(TXEN0);   /* Enable RX and TX */
+  UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);   /* Enable RX and TX, RX interrupt */
 }
 
 void uart1_init(void) {
+  ring_init(&rx1);
+  ring_init(&tx1);
+
   UBRR1 = 103;
   
   UCSR1A &= ~(_BV(U2X1));
 
   UCSR1C = _BV(UCSZ11) | _BV(UCSZ10); /* 8-bit data */
-  UCSR1B = _BV(RXEN1) | _BV(TXEN1);   /* Enable RX and TX */
+  UCSR1B = _BV(RXEN1) | _BV(TXEN1) | _BV(RXCIE1);   /* Enable RX and TX, RX interrupt */
 }
 
 void uart0_sendbyte(uint8_t data){
-  while(!(UCSR0A & (1<<UDRE0)));
-  UDR0 = data;
+  ring_put(&tx0, data);
+  UCSR0B |= _BV(UDRIE0);
 }
 
 uint8_t uart0_recvbyte(void){
-  while(!(UCSR0A & (1<<RXC0)));
-  return UDR0;
+  return ring_get(&rx0);
 }
 
 void uart0_sendstr(char* input){
@@ -39,13 +145,12 @@ void uart0_sendstr(char* input){
 }
 
 void uart1_sendbyte(uint8_t data){
-  while(!(UCSR1A & (1<<UDRE1)));
-  UDR1 = data;
+  ring_put(&tx1, data);
+  UCSR1B |= _BV(UDRIE1);
 }
 
 uint8_t uart1_recvbyte(void){
-  while(!(UCSR1A & (1<<RXC1)));
-  return UDR1;
+  return ring_get(&rx1);
 }
 
 void uart1_sendstr(char* input){
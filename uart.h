@@ -13,6 +13,8 @@
 #include <util/setbaud.h>
 #include <avr/sfr_defs.h>
 
+/* Size of each RX/TX ring, must be a power of two no larger than 128 */
+#define UART_BUFFER 32
 
 
 void uart0_init(void);